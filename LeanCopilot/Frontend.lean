@@ -2,8 +2,6 @@
 import Lean
 import LeanCopilot.Options
 import Lean.Meta.Tactic.TryThis
-import Batteries.Data.MLList.Basic
-import Batteries.Control.Nondet.Basic
 
 open Lean Parser Elab Tactic
 
@@ -56,24 +54,31 @@ def withoutInfoTrees (t : TacticM Unit) : TacticM Unit := do
 
 
 open Lean.Meta.Tactic.TryThis in
-def hint (stx : Syntax) (tacStrs : Array String) (check : Bool) : TacticM Unit := do
-  if check then
-    let tacStxs ← tacStrs.filterMapM fun tstr : String => do match runParserCategory (← getEnv) `tactic tstr with
-      | Except.error _ => return none
-      | Except.ok stx => return some (tstr, stx)
-    let tacs := Nondet.ofList tacStxs.toList
-    let results := tacs.filterMapM fun t : (String × Syntax) => do
-      if let some msgs ← observing? (withMessageLog (withoutInfoTrees (evalTactic t.2))) then
-        return some (← getGoals, ← suggestion t.1 msgs)
-      else
-        return none
-    let results ← (results.toMLList.takeUpToFirst fun r => r.1.1.isEmpty).asArray
-    let results := results.qsort (·.1.1.length < ·.1.1.length)
-    addSuggestions stx (results.map (·.1.2))
-    match results.find? (·.1.1.isEmpty) with
-    | some r =>
-      setMCtx r.2.term.meta.meta.mctx
-    | none => admitGoal (← getMainGoal)
-  else
-    let tacsNoCheck : Array Suggestion := tacStrs.map fun tac => { suggestion := SuggestionText.string tac }
+/--
+Suggest the tactics from `tactics`. With `check`, each one is run as soon as `tactics` returns it, e.g.,
+while the model is still generating the rest, until one closes the goal, which is then left closed by it;
+otherwise the goal is admitted.
+-/
+def hint (stx : Syntax) (tactics : LeanCopilot.OutputStream) (check : Bool) : TacticM Unit := do
+  if ¬ check then
+    let tacsNoCheck : Array Suggestion := (← tactics.toArray).map fun (tac, _) => { suggestion := SuggestionText.string tac }
     addSuggestions stx tacsNoCheck
+    return
+  let initial ← saveState
+  let mut results : Array (List MVarId × Suggestion × Tactic.SavedState) := #[]
+  repeat
+    let some (tstr, _) ← tactics.next | break
+    let .ok tacStx := runParserCategory (← getEnv) `tactic tstr | continue
+    initial.restore
+    if let some msgs ← observing? (withMessageLog (withoutInfoTrees (evalTactic tacStx))) then
+      let goals ← getGoals
+      results := results.push (goals, ← suggestion tstr msgs, ← saveState)
+      if goals.isEmpty then
+        break
+  initial.restore
+  let results := results.qsort (·.1.length < ·.1.length)
+  addSuggestions stx (results.map (·.2.1))
+  match results.find? (·.1.isEmpty) with
+  | some r =>
+    setMCtx r.2.2.term.meta.meta.mctx
+  | none => admitGoal (← getMainGoal)
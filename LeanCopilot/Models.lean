@@ -1,8 +1,10 @@
 import LeanCopilot.Models.Builtin
 import LeanCopilot.Models.ByT5
+import LeanCopilot.Models.Completion
 import LeanCopilot.Models.Native
 import LeanCopilot.Models.External
 import LeanCopilot.Models.Generic
 import LeanCopilot.Models.FFI
 import LeanCopilot.Models.Interface
+import LeanCopilot.Models.Memory
 import LeanCopilot.Models.Registry
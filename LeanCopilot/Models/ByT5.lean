@@ -289,10 +289,38 @@ def detokenize (tokens : Array String) : String :=
 def eosToken := "</s>"
 
 
+/-- Ids `0`, `1`, and `2` are `<pad>`, `</s>`, and `<unk>`, followed by one id per byte. -/
+private def numSpecialTokens : UInt32 := 3
+
+
+def tokenizeIds (text : String) : Array UInt32 :=
+  text.toUTF8.data.map (·.toUInt32 + numSpecialTokens)
+
+
+def detokenizeIds (ids : Array UInt32) : String :=
+  let bytes := ids.filterMap fun i =>
+    if numSpecialTokens ≤ i ∧ i < numSpecialTokens + 256 then some (i - numSpecialTokens).toUInt8 else none
+  match String.fromUTF8? ⟨bytes⟩ with
+  | some s => s
+  | none => ""
+
+
+def eosTokenId : UInt32 := 1
+
+
+def idTokenizer : IdTokenizer := {
+  tokenize := tokenizeIds,
+  detokenize := detokenizeIds,
+  eosTokenId := eosTokenId
+}
+
+
 def tokenizer : Tokenizer := {
   tokenize := tokenize,
   detokenize := detokenize,
   eosToken := eosToken
+  native? := some .byt5
+  ids? := some idTokenizer
 }
 
 
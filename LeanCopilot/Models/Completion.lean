@@ -0,0 +1,54 @@
+import LeanCopilot.Models.Interface
+
+set_option autoImplicit false
+
+namespace LeanCopilot
+
+
+/--
+A session completing a target prefix typed incrementally for a fixed input, e.g., a tactic typed
+character by character. ctranslate2 doesn't expose decoder states to resume, so the session keeps the
+completions of recent prefixes instead. When the prefix is extended (or shortened back), completions
+still consistent with it are returned right away, and the model decodes again only when fewer than
+`minResults?` remain, or by default fewer than the generation they come from returned.
+
+Cached completions differ from a fresh generation of the longer prefix: they come from a beam decoded
+for a shorter prefix, and their scores are not renormalized.
+-/
+structure CompletionSession (τ : Type) where
+  model : τ
+  input : String
+  minResults? : Option Nat
+  maxHistory : Nat
+  history : IO.Ref (Array (String × Array (String × Float)))
+
+
+namespace CompletionSession
+
+
+def new {τ : Type} (model : τ) (input : String) (minResults? : Option Nat := none) (maxHistory : Nat := 16) :
+    IO (CompletionSession τ) := do
+  return {model, input, minResults?, maxHistory, history := ← IO.mkRef #[]}
+
+
+/-- Completions of `targetPrefix`, which include the prefix itself as `generate`'s outputs do. -/
+def complete {τ : Type} [TextToText τ] (session : CompletionSession τ) (targetPrefix : String) :
+    IO (Array (String × Float)) := do
+  let history ← session.history.get
+  -- The completions of the longest cached prefix of `targetPrefix` are the most likely to match.
+  let cached? := history.foldl (init := none) fun best? (p, outputs) =>
+    if targetPrefix.startsWith p ∧ (best?.all fun (q, _) => q.length < p.length) then some (p, outputs) else best?
+  if let some (_, outputs) := cached? then
+    let consistent := outputs.filter (·.1.startsWith targetPrefix)
+    if consistent.size ≥ session.minResults?.getD outputs.size ∧ ¬ consistent.isEmpty then
+      return consistent
+  let outputs ← generate session.model session.input targetPrefix
+  let history := history.filter (·.1 != targetPrefix) |>.push (targetPrefix, outputs)
+  session.history.set $ history.extract (history.size - session.maxHistory) history.size
+  return outputs
+
+
+end CompletionSession
+
+
+end LeanCopilot
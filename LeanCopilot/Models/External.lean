@@ -74,7 +74,8 @@ def ExternalGenerator.generate (model : ExternalGenerator) (input : String) (tar
   return res.outputs.map fun g => (g.output, g.score)
 
 
-instance : TextToText ExternalGenerator := ⟨ExternalGenerator.generate⟩
+instance : TextToText ExternalGenerator where
+  generate := ExternalGenerator.generate
 
 
 structure ExternalEncoder extends ExternalModel
@@ -2,49 +2,193 @@ import Lean
 import LeanCopilot.Models.Interface
 import LeanCopilot.Models.Native
 import LeanCopilot.Models.Builtin
+import LeanCopilot.Models.Memory
 
 namespace LeanCopilot
 
 set_option autoImplicit false
 
+
+/--
+Results packed into flat buffers by `cpp/ct2.cpp`, which cost a constant number of Lean allocations
+instead of one per string. `text` concatenates the UTF-8 bytes of all strings, the `i`-th of which spans
+`offsets[i]` to `offsets[i+1]`. Each result has one of the `scores` and owns one or more consecutive strings.
+-/
+structure PackedResults where
+  text : ByteArray
+  offsets : Array UInt32
+  scores : FloatArray
+
+
+namespace PackedResults
+
+
+def size (r : PackedResults) : Nat := r.scores.size
+
+
+def numStrings (r : PackedResults) : Nat := r.offsets.size - 1
+
+
+/-- The `i`-th string, decoded only when accessed. Like `ByT5.detokenize`, it is empty if invalid UTF-8. -/
+def string! (r : PackedResults) (i : Nat) : String :=
+  String.fromUTF8? (r.text.extract r.offsets[i]!.toNat r.offsets[i + 1]!.toNat) |>.getD ""
+
+
+/-- Unpack results owning one string each, e.g., generated texts. -/
+def toOutputs (r : PackedResults) : Array (String × Float) :=
+  (Array.range r.size).map fun i => (r.string! i, r.scores.get! i)
+
+
+def ofOutputs (outputs : Array (String × Float)) : PackedResults :=
+  outputs.foldl (init := {text := .empty, offsets := #[0], scores := .empty}) fun r (s, score) =>
+    let text := r.text ++ s.toUTF8
+    {text, offsets := r.offsets.push text.size.toUInt32, scores := r.scores.push score}
+
+
+end PackedResults
+
+
 namespace FFI
 
 
-@[extern "is_generator_initialized"]
-opaque isGeneratorInitialized : (name : @& String) → Bool
+opaque GeneratorHandlePointed : NonemptyType
+
+/-- A generator loaded by `cpp/ct2.cpp`, freed by its finalizer once no longer referenced. -/
+def GeneratorHandle : Type := GeneratorHandlePointed.type
+
+instance : Nonempty GeneratorHandle := GeneratorHandlePointed.property
+
+opaque EncoderHandlePointed : NonemptyType
+
+/-- An encoder loaded by `cpp/ct2.cpp`, freed by its finalizer once no longer referenced. -/
+def EncoderHandle : Type := EncoderHandlePointed.type
+
+instance : Nonempty EncoderHandle := EncoderHandlePointed.property
+
+opaque GenerationStreamPointed : NonemptyType
 
-@[extern "is_encoder_initialized"]
-opaque isEncoderInitialized : (name : @& String) → Bool
+/-- A generation running in the background in `cpp/ct2.cpp`, which stops decoding once no longer referenced. -/
+def GenerationStream : Type := GenerationStreamPointed.type
+
+instance : Nonempty GenerationStream := GenerationStreamPointed.property
 
 @[extern "init_generator"]
-opaque initGenerator (name : @& String) (modelPath : @& String) (computeType : @& String) (device : @& String) (deviceIndex : @& Array UInt64) : Bool
+opaque initGenerator (modelPath : @& String) (computeType : @& String) (device : @& String) (deviceIndex : @& Array UInt64)
+  (interThreads : UInt64) (intraThreads : UInt64) (maxQueuedBatches : Int64) (cpuCoreOffset : Int64) (maxWaitingRequests : UInt64) :
+  IO GeneratorHandle
 
 @[extern "init_encoder"]
-opaque initEncoder (name : @& String) (modelPath : @& String) (computeType : @& String) (device : @& String) (deviceIndex : @& Array UInt64) : Bool
+opaque initEncoder (modelPath : @& String) (computeType : @& String) (device : @& String) (deviceIndex : @& Array UInt64)
+  (interThreads : UInt64) (intraThreads : UInt64) (maxQueuedBatches : Int64) (cpuCoreOffset : Int64) : IO EncoderHandle
 
 @[extern "generate"]
-opaque generate (name : @& String) (inputTokens : @& Array String) (targetPrefixTokens : @& Array String) (numReturnSequences : UInt64) (beamSize : UInt64)
+opaque generate (generator : @& GeneratorHandle) (inputTokens : @& Array String) (targetPrefixTokens : @& Array String) (numReturnSequences : UInt64) (beamSize : UInt64)
   (minLength : UInt64) (maxLength : UInt64) (lengthPenalty : Float) (patience : Float) (temperature : Float)
-  : Array (Array String × Float)
+  (samplingTopK : UInt64) (endTokens : @& Array String) (eosToken : @& String)
+  (suppressedSequences : @& Array (Array String)) (suppressedEndings : @& Array (Array String))
+  (deadlineMs : UInt64) (priority : UInt8) (cancelled : @& IO Bool)
+  : IO (Array (Array String × Float) × UInt8)
+
+/--
+Running generations, waiting ones by priority class, rejected ones so far, and batches queued and running
+in ctranslate2.
+-/
+@[extern "generator_stats"]
+opaque generatorStats (generator : @& GeneratorHandle) : IO (Array UInt64)
+
+/-- Run `inputTokens` once on every replica, see `NativeGenerator.warmup`. -/
+@[extern "warmup_generator"]
+opaque warmupGenerator (generator : @& GeneratorHandle) (inputTokens : @& Array String) (numReturnSequences : UInt64)
+  (beamSize : UInt64) (maxLength : UInt64) (temperature : Float) (samplingTopK : UInt64) : IO Unit
+
+@[extern "warmup_encoder"]
+opaque warmupEncoder (encoder : @& EncoderHandle) (inputTokens : @& Array String) : IO Unit
+
+@[extern "score"]
+opaque score (generator : @& GeneratorHandle) (inputTokens : @& Array (Array String)) (targetTokens : @& Array (Array String)) :
+  IO FloatArray
+
+@[extern "byt5_score"]
+opaque byt5Score (generator : @& GeneratorHandle) (inputs : @& Array String) (targets : @& Array String) : IO FloatArray
 
 @[extern "encode"]
-opaque encode (name : @& String) (inputTokens : @& Array String) : FloatArray
+opaque encode (encoder : @& EncoderHandle) (inputTokens : @& Array String) (cancelled : @& IO Bool) : IO FloatArray
+
+@[extern "byt5_generate"]
+opaque byt5Generate (generator : @& GeneratorHandle) (input : @& String) (targetPrefix : @& String) (numReturnSequences : UInt64) (beamSize : UInt64)
+  (minLength : UInt64) (maxLength : UInt64) (lengthPenalty : Float) (patience : Float) (temperature : Float)
+  (samplingTopK : UInt64) (endTokens : @& Array String) (suppressedSequences : @& Array String) (suppressedEndings : @& Array String)
+  (constrainSyntax : Bool) (keywords : @& Array String) (deduplicate : Bool) (deadlineMs : UInt64) (priority : UInt8)
+  (cancelled : @& IO Bool) : IO (PackedResults × UInt8)
+
+@[extern "byt5_generate_prefixes"]
+opaque byt5GeneratePrefixes (generator : @& GeneratorHandle) (input : @& String) (targetPrefixes : @& Array String) (numReturnSequences : UInt64) (beamSize : UInt64)
+  (minLength : UInt64) (maxLength : UInt64) (lengthPenalty : Float) (patience : Float) (temperature : Float)
+  (samplingTopK : UInt64) (endTokens : @& Array String) (suppressedSequences : @& Array String) (suppressedEndings : @& Array String)
+  (constrainSyntax : Bool) (keywords : @& Array String) (deduplicate : Bool) (priority : UInt8) (cancelled : @& IO Bool)
+  : IO (Array (Array (String × Float)))
+
+@[extern "byt5_generate_stream"]
+opaque byt5GenerateStream (generator : @& GeneratorHandle) (input : @& String) (targetPrefix : @& String) (numReturnSequences : UInt64) (beamSize : UInt64)
+  (minLength : UInt64) (maxLength : UInt64) (lengthPenalty : Float) (patience : Float) (temperature : Float)
+  (samplingTopK : UInt64) (endTokens : @& Array String) (suppressedSequences : @& Array String) (suppressedEndings : @& Array String)
+  (constrainSyntax : Bool) (keywords : @& Array String) (deduplicate : Bool) (priority : UInt8) (cancelled : @& IO Bool) :
+  IO (GenerationStream × UInt8)
+
+/-- Wait for the next output, or `none` once all are returned or `cancelled` returns true. -/
+@[extern "generation_stream_next"]
+opaque GenerationStream.next (stream : @& GenerationStream) (cancelled : @& IO Bool) : IO (Option (String × Float))
+
+@[extern "generate_alternatives"]
+opaque generateAlternatives (generator : @& GeneratorHandle) (inputTokens : @& Array String) (targetPrefixTokens : @& Array String) (numAlternatives : UInt64)
+  (maxLength : UInt64) (endTokens : @& Array String) (eosToken : @& String) : IO (Array (Array String × Float))
+
+@[extern "byt5_generate_alternatives"]
+opaque byt5GenerateAlternatives (generator : @& GeneratorHandle) (input : @& String) (targetPrefix : @& String) (numAlternatives : UInt64)
+  (maxLength : UInt64) (endTokens : @& Array String) : IO (Array (String × Float))
+
+@[extern "generate_ids"]
+opaque generateIds (generator : @& GeneratorHandle) (inputIds : @& Array UInt32) (targetPrefixIds : @& Array UInt32) (numReturnSequences : UInt64) (beamSize : UInt64)
+  (minLength : UInt64) (maxLength : UInt64) (lengthPenalty : Float) (patience : Float) (temperature : Float)
+  (samplingTopK : UInt64) (endTokenIds : @& Array UInt32) (eosTokenId : UInt32)
+  (suppressedSequences : @& Array (Array UInt32)) (suppressedEndings : @& Array (Array UInt32))
+  (deadlineMs : UInt64) (priority : UInt8) (cancelled : @& IO Bool)
+  : IO (Array (Array UInt32 × Float) × UInt8)
+
+@[extern "encode_ids"]
+opaque encodeIds (encoder : @& EncoderHandle) (inputIds : @& Array UInt32) (cancelled : @& IO Bool) : IO FloatArray
+
+@[extern "byt5_encode"]
+opaque byt5Encode (encoder : @& EncoderHandle) (input : @& String) (cancelled : @& IO Bool) : IO FloatArray
 
 @[extern "init_premise_embeddings"]
 opaque initPremiseEmbeddings (path : @& String) (device : @& String) : Bool
 
 @[extern "premise_embeddings_initialized"]
-opaque premiseEmbeddingsInitialized : Unit → Bool
+opaque premiseEmbeddingsInitialized : IO Bool
+
+@[extern "premise_embeddings_bytes"]
+opaque premiseEmbeddingsBytes : IO UInt64
+
+@[extern "unload_premise_embeddings"]
+opaque unloadPremiseEmbeddings : IO Unit
 
 @[extern "init_premise_dictionary"]
 opaque initPremiseDictionary (path : @& String) : Bool
 
 @[extern "premise_dictionary_initialized"]
-opaque premiseDictionaryInitialized : Unit → Bool
+opaque premiseDictionaryInitialized : IO Bool
+
+@[extern "unload_premise_dictionary"]
+opaque unloadPremiseDictionary : IO Unit
 
 @[extern "retrieve"]
 opaque retrieve (queryEmb : @& FloatArray) (k : UInt64) : Array (String × String × String × Float)
 
+/-- Like `retrieve`, but packing each premise's full name, path, and code. -/
+@[extern "retrieve_packed"]
+opaque retrievePacked (queryEmb : @& FloatArray) (k : UInt64) : PackedResults
+
 @[extern "cuda_available"]
 opaque cudaAvailable : Unit → Bool
 
@@ -55,22 +199,206 @@ end FFI
 def cudaAvailable : Bool := FFI.cudaAvailable ()
 
 
+/-- Generators loaded so far by `NativeModel.loadKey`. -/
+initialize generatorHandlesRef : IO.Ref (Std.HashMap String FFI.GeneratorHandle) ← IO.mkRef {}
+
+/-- Encoders loaded so far by `NativeModel.loadKey`. -/
+initialize encoderHandlesRef : IO.Ref (Std.HashMap String FFI.EncoderHandle) ← IO.mkRef {}
+
+
+namespace NativeModel
+
+
+/-- Where to load the model from, preferring weights quantized ahead of time for int8 compute types. -/
+private def checkPath (model : NativeModel) : IO System.FilePath := do
+  let path ← model.path
+  if ¬ (← path.pathExists) then
+    throw $ IO.userError s!"Cannot find the model {model.name}. Please run `lake exe download {model.url}`."
+  if model.computeType.isInt8 then
+    let quantizedPath ← getQuantizedModelDir model.url
+    if ← (quantizedPath / "model.bin").pathExists then
+      return quantizedPath
+  return path
+
+
+/--
+Size of the model's weights on disk, which is what it takes in memory for the compute type it was converted with.
+Counted once per device, since replicas on the same device share the weights.
+-/
+private def getBytes (model : NativeModel) (path : System.FilePath) : IO Nat := do
+  let bytes := (← (path / "model.bin").metadata).byteSize.toNat
+  return bytes * max model.deviceIndex.size 1
+
+
+/--
+The model's URL with everything it is loaded with, so that the same model loaded differently, e.g., on another
+device or with other queue limits, gets a handle of its own instead of reusing the first one, and so do
+checkpoints sharing a name in different repositories.
+-/
+def loadKey (model : NativeModel) : String :=
+  s!"{model.url}:{model.device}:{model.deviceIndex}:{model.computeType}:{model.interThreads}:{model.intraThreads}:" ++
+    s!"{model.maxQueuedBatches}:{model.cpuCoreOffset}:{model.maxWaitingRequests}"
+
+
+private def generatorKey (model : NativeModel) : String := s!"generator:{model.loadKey}"
+
+
+private def encoderKey (model : NativeModel) : String := s!"encoder:{model.loadKey}"
+
+
+/--
+The handle of the model loaded as a generator, loading it on first use or after it was unloaded
+to stay within the `MemoryBudget`. `onLoad` runs on newly loaded handles, e.g., to warm them up.
+Concurrent calls, e.g., from `preload`, share one load.
+-/
+def getGeneratorHandle (model : NativeModel) (onLoad : FFI.GeneratorHandle → IO Unit := fun _ => return ()) :
+    IO FFI.GeneratorHandle := do
+  let key := model.generatorKey
+  if let some handle := (← generatorHandlesRef.get)[model.loadKey]? then
+    touchResident key
+    return handle
+  let path ← model.checkPath
+  loadOnce key do
+    if (← generatorHandlesRef.get).contains model.loadKey then
+      return
+    let bytes ← model.getBytes path
+    reserveMemory key bytes
+    let handle ← FFI.initGenerator path.toString model.computeType.toString model.device.toString model.deviceIndex
+      model.interThreads model.intraThreads model.maxQueuedBatches model.cpuCoreOffset model.maxWaitingRequests
+    generatorHandlesRef.modify (·.insert model.loadKey handle)
+    admitResident key bytes (generatorHandlesRef.modify (·.erase model.loadKey))
+    onLoad handle
+  let some handle := (← generatorHandlesRef.get)[model.loadKey]?
+    | throw $ IO.userError s!"{model.name} was unloaded right after loading. The memory budget may be too small."
+  return handle
+
+
+/-- Like `getGeneratorHandle`, but for the model loaded as an encoder. -/
+def getEncoderHandle (model : NativeModel) (onLoad : FFI.EncoderHandle → IO Unit := fun _ => return ()) :
+    IO FFI.EncoderHandle := do
+  let key := model.encoderKey
+  if let some handle := (← encoderHandlesRef.get)[model.loadKey]? then
+    touchResident key
+    return handle
+  let path ← model.checkPath
+  loadOnce key do
+    if (← encoderHandlesRef.get).contains model.loadKey then
+      return
+    let bytes ← model.getBytes path
+    reserveMemory key bytes
+    let handle ← FFI.initEncoder path.toString model.computeType.toString model.device.toString model.deviceIndex
+      model.interThreads model.intraThreads model.maxQueuedBatches model.cpuCoreOffset
+    encoderHandlesRef.modify (·.insert model.loadKey handle)
+    admitResident key bytes (encoderHandlesRef.modify (·.erase model.loadKey))
+    onLoad handle
+  let some handle := (← encoderHandlesRef.get)[model.loadKey]?
+    | throw $ IO.userError s!"{model.name} was unloaded right after loading. The memory budget may be too small."
+  return handle
+
+
+/-- Drop the handles loaded with the model's configuration, so that they are freed once calls still using them return. -/
+def unload (model : NativeModel) : IO Unit := do
+  unloadResident model.generatorKey
+  unloadResident model.encoderKey
+  generatorHandlesRef.modify (·.erase model.loadKey)
+  encoderHandlesRef.modify (·.erase model.loadKey)
+
+
+end NativeModel
+
+
+/-- Outputs of a generation bounded by a deadline or rejected under load. -/
+structure GenerationResult where
+  outputs : Array (String × Float)
+  /-- Whether decoding stopped at the deadline, so that some outputs may be unfinished or missing. -/
+  isPartial : Bool := false
+  /-- Whether the generation was rejected without outputs because too many others were waiting. -/
+  isBusy : Bool := false
+deriving Repr
+
+
+/-- Decode the status returned by `cpp/ct2.cpp` with the outputs. -/
+private def GenerationResult.ofStatus (outputs : Array (String × Float)) (status : UInt8) : GenerationResult :=
+  {outputs, isPartial := status == 1, isBusy := status == 2}
+
+
+/-- Queue depths of a native generator, to monitor overload. -/
+structure QueueStats where
+  running : Nat
+  waitingInteractive : Nat
+  waitingSearch : Nat
+  waitingBackground : Nat
+  /-- Generations rejected so far because `NativeModel.maxWaitingRequests` were already waiting. -/
+  rejected : Nat
+  /-- Batches queued in ctranslate2, which are at most one per replica besides streams. -/
+  ct2QueuedBatches : Nat
+  ct2ActiveBatches : Nat
+deriving Repr
+
+
+/-- A typical tactic state, which models are warmed up with. -/
+def warmupInput : String :=
+  "α : Type u_1\ninst✝ : Field α\na b : α\nha : 0 < a\nhb : 0 < b\n⊢ a / (a + b) + b / (a + b) = 1"
+
+
 namespace NativeGenerator
 
 
-def generate (model : NativeGenerator) (input : String) (targetPrefix : String) : IO $ Array (String × Float) := do
-  if ¬ FFI.isGeneratorInitialized model.name then
-    let path ← model.path
-    if ¬ (← path.pathExists) then
-      throw $ IO.userError s!"Cannot find the model {model.name}. Please run `lake exe download {model.url}`."
-    let device := model.device.toString
-    let computeType := model.computeType.toString
-    if ¬ (FFI.initGenerator model.name path.toString computeType device model.deviceIndex) then
-      throw $ IO.userError s!"Failed to initialize model {model.name}"
+/-- Tokenize each end token, which must be a single token. -/
+private def tokenizeEndTokens {α : Type} (endTokens : Array String) (tokenize : String → Array α) : IO (Array α) :=
+  endTokens.mapM fun t => do
+    let ts := tokenize t
+    if h : ts.size = 1 then
+      return ts[0]
+    else
+      throw $ IO.userError s!"{repr t} is not a single token and cannot be used as an end token."
+
+
+/-- Run `warmupInput` through every replica of `handle` with the model's parameters. -/
+private def warmupHandle (model : NativeGenerator) (handle : FFI.GeneratorHandle) : IO Unit := do
+  let params := model.params
+  let inputTokens := model.tokenizer.tokenize warmupInput |>.push model.tokenizer.eosToken
+  FFI.warmupGenerator handle inputTokens params.numReturnSequences params.beamSize params.maxLength params.temperature
+    params.samplingTopK
+
+
+/-- Load the model if needed, warming it up once loaded if `NativeModel.warmupOnLoad` is set. -/
+private def getHandle (model : NativeGenerator) : IO FFI.GeneratorHandle :=
+  model.getGeneratorHandle fun handle => do
+    if model.warmupOnLoad then
+      model.warmupHandle handle
 
+
+/--
+Run a representative dummy input through every replica at the configured beam size, loading the model
+if needed, so that later calls do not pay for lazy allocations, kernel selection, and cold caches.
+Editors and build workers can call it off the critical path, e.g., in an `IO.asTask`. It waits for
+replicas at `Priority.background`, behind other requests, and skips them if rejected under load.
+-/
+def warmup (model : NativeGenerator) : IO Unit := do
+  model.warmupHandle (← model.getHandle)
+
+
+private def byt5GeneratePacked (model : NativeGenerator) (input : String) (targetPrefix : String) (deadlineMs : UInt64)
+    (priority : Priority) (cancelled : IO Bool) : IO (PackedResults × UInt8) := do
+  let handle ← model.getHandle
+  let params := model.params
+  let _ ← tokenizeEndTokens params.endTokens model.tokenizer.tokenize
+  let keywords := params.syntaxConstraint?.map (·.keywords) |>.getD #[]
+  FFI.byt5Generate handle input targetPrefix params.numReturnSequences params.beamSize params.minLength params.maxLength
+    params.lengthPenalty params.patience params.temperature params.samplingTopK params.endTokens params.suppressedSequences
+    params.suppressedEndings params.syntaxConstraint?.isSome keywords params.deduplicate deadlineMs priority.toUInt8
+    cancelled
+
+
+private def generateAux (model : NativeGenerator) (input : String) (targetPrefix : String) (deadlineMs : UInt64)
+    (priority : Priority) (cancelled : IO Bool) : IO GenerationResult := do
   let tokenizer := model.tokenizer
-  let inputTokens := tokenizer.tokenize input |>.push tokenizer.eosToken
-  let targetPrefixTokens := tokenizer.tokenize targetPrefix
+  if tokenizer.native? == some .byt5 then
+    let (packed, status) ← byt5GeneratePacked model input targetPrefix deadlineMs priority cancelled
+    return .ofStatus packed.toOutputs status
+
+  let handle ← model.getHandle
   let numReturnSequences := model.params.numReturnSequences
   let beamSize := model.params.beamSize
   let minLength := model.params.minLength
@@ -78,13 +406,172 @@ def generate (model : NativeGenerator) (input : String) (targetPrefix : String)
   let lengthPenalty := model.params.lengthPenalty
   let patience := model.params.patience
   let temperature := model.params.temperature
-  let tokensWithScores := FFI.generate model.name inputTokens targetPrefixTokens numReturnSequences beamSize minLength maxLength lengthPenalty patience temperature
+  let samplingTopK := model.params.samplingTopK
+  let endTokens := model.params.endTokens
+  let suppressedSequences := model.params.suppressedSequences
+  let suppressedEndings := model.params.suppressedEndings
+  let syntaxConstraint? := model.params.syntaxConstraint?
+  let deduplicate := model.params.deduplicate
+
+  if syntaxConstraint?.isSome then
+    throw $ IO.userError s!"{model.name} does not support syntax constraints, which require a native tokenizer."
+  if deduplicate then
+    throw $ IO.userError s!"{model.name} does not support deduplication, which requires a native tokenizer."
+
+  if let some idTokenizer := tokenizer.ids? then
+    let inputIds := idTokenizer.tokenize input |>.push idTokenizer.eosTokenId
+    let targetPrefixIds := idTokenizer.tokenize targetPrefix
+    let endTokenIds ← tokenizeEndTokens endTokens idTokenizer.tokenize
+    let (idsWithScores, status) ← FFI.generateIds handle inputIds targetPrefixIds numReturnSequences beamSize minLength maxLength lengthPenalty patience temperature
+      samplingTopK endTokenIds idTokenizer.eosTokenId (suppressedSequences.map idTokenizer.tokenize) (suppressedEndings.map idTokenizer.tokenize)
+      deadlineMs priority.toUInt8 cancelled
+    return .ofStatus (idsWithScores.map fun ((ids, s) : Array UInt32 × Float) => (idTokenizer.detokenize ids, s)) status
+
+  let inputTokens := tokenizer.tokenize input |>.push tokenizer.eosToken
+  let targetPrefixTokens := tokenizer.tokenize targetPrefix
+  let endTokens ← tokenizeEndTokens endTokens tokenizer.tokenize
+  let (tokensWithScores, status) ← FFI.generate handle inputTokens targetPrefixTokens numReturnSequences beamSize minLength maxLength lengthPenalty patience temperature
+    samplingTopK endTokens tokenizer.eosToken (suppressedSequences.map tokenizer.tokenize) (suppressedEndings.map tokenizer.tokenize)
+    deadlineMs priority.toUInt8 cancelled
+
+  return .ofStatus (tokensWithScores.filterMap fun ((ts, s) : Array String × Float) => (tokenizer.detokenize ts, s)) status
+
+
+/-- Throw for generations rejected under load when there is no way to return it. -/
+private def checkNotBusy (model : NativeGenerator) (isBusy : Bool) : IO Unit := do
+  if isBusy then
+    throw $ IO.userError s!"{model.name} is busy: too many generations are waiting for it."
+
+
+/--
+Generate from `input` and `targetPrefix`. Decoding stops early once `cancelled` returns true, e.g., when Lean
+aborts the elaboration waiting for it, in which case there are no outputs. By default, that is when the
+current task is cancelled. `priority` orders the calls waiting for a replica. Throws if the call is
+rejected under load, see `NativeModel.maxWaitingRequests` and `generateWithDeadline`.
+-/
+def generate (model : NativeGenerator) (input : String) (targetPrefix : String) (cancelled : IO Bool := IO.checkCanceled)
+    (priority : Priority := .interactive) : IO $ Array (String × Float) := do
+  let result ← generateAux model input targetPrefix 0 priority cancelled
+  checkNotBusy model result.isBusy
+  return result.outputs
+
+
+/--
+Like `generate`, but returning within about `deadlineMs` milliseconds for interactive use. Greedy decoding
+and sampling (`beamSize := 1`) then stop with the hypotheses decoded so far, finished or not. Beam search
+cannot be interrupted, so it returns no outputs if it misses the deadline. Calls rejected under load return
+no outputs either, marked as busy, so that callers can skip them. `0` means no deadline.
+-/
+def generateWithDeadline (model : NativeGenerator) (input : String) (targetPrefix : String) (deadlineMs : UInt64)
+    (cancelled : IO Bool := IO.checkCanceled) (priority : Priority := .interactive) : IO GenerationResult :=
+  generateAux model input targetPrefix deadlineMs priority cancelled
+
+
+/--
+Like `generate`, but returning packed results. The native ByT5 tokenizer builds them natively with a constant
+number of Lean allocations, and the strings are only decoded when accessed.
+-/
+def generatePacked (model : NativeGenerator) (input : String) (targetPrefix : String)
+    (cancelled : IO Bool := IO.checkCanceled) (priority : Priority := .interactive) : IO PackedResults := do
+  if model.tokenizer.native? == some .byt5 then
+    let (packed, status) ← byt5GeneratePacked model input targetPrefix 0 priority cancelled
+    checkNotBusy model (GenerationResult.ofStatus #[] status).isBusy
+    return packed
+  else
+    return .ofOutputs (← generate model input targetPrefix cancelled priority)
+
+
+/--
+Like `generate`, but returning outputs as soon as they are finished, e.g., to check the first tactics while
+the rest are still being decoded. With the native ByT5 tokenizer, greedy decoding and sampling (`beamSize := 1`)
+return outputs during decoding, which stops when the stream is dropped, and beam search returns them once it
+completes. Other tokenizers return all outputs at once. Streams wait for a replica like `generate`,
+and are empty and marked as busy if rejected under load.
+-/
+def generateStream (model : NativeGenerator) (input : String) (targetPrefix : String)
+    (cancelled : IO Bool := IO.checkCanceled) (priority : Priority := .interactive) : IO OutputStream := do
+  if model.tokenizer.native? != some .byt5 then
+    let result ← generateWithDeadline model input targetPrefix 0 cancelled priority
+    return {← OutputStream.ofArray result.outputs with isBusy := result.isBusy}
+  let handle ← model.getHandle
+  let params := model.params
+  let _ ← tokenizeEndTokens params.endTokens model.tokenizer.tokenize
+  let keywords := params.syntaxConstraint?.map (·.keywords) |>.getD #[]
+  let (stream, status) ← FFI.byt5GenerateStream handle input targetPrefix params.numReturnSequences params.beamSize
+    params.minLength params.maxLength params.lengthPenalty params.patience params.temperature params.samplingTopK
+    params.endTokens params.suppressedSequences params.suppressedEndings params.syntaxConstraint?.isSome keywords
+    params.deduplicate priority.toUInt8 cancelled
+  return {next := stream.next cancelled, isBusy := status == 2}
+
+
+/--
+Generate for several target prefixes of the same input. The native ByT5 tokenizer decodes all prefixes
+in one batch; other tokenizers generate per prefix. The input is still encoded once per prefix, since
+ctranslate2 cannot reuse encoder outputs, so the batch only saves per-call overhead. Waits for a replica
+like `generate`, and throws if rejected under load. Returns no outputs if cancelled.
+-/
+def generateWithPrefixes (model : NativeGenerator) (input : String) (targetPrefixes : Array String)
+    (cancelled : IO Bool := IO.checkCanceled) (priority : Priority := .interactive) :
+    IO $ Array (Array (String × Float)) := do
+  if model.tokenizer.native? != some .byt5 then
+    return ← targetPrefixes.mapM fun targetPrefix => model.generate input targetPrefix cancelled priority
+  let handle ← model.getHandle
+  let params := model.params
+  let _ ← tokenizeEndTokens params.endTokens model.tokenizer.tokenize
+  let keywords := params.syntaxConstraint?.map (·.keywords) |>.getD #[]
+  FFI.byt5GeneratePrefixes handle input targetPrefixes params.numReturnSequences params.beamSize params.minLength params.maxLength
+    params.lengthPenalty params.patience params.temperature params.samplingTopK params.endTokens params.suppressedSequences params.suppressedEndings
+    params.syntaxConstraint?.isSome keywords params.deduplicate priority.toUInt8 cancelled
+
+
+/--
+Cheap completions for interactive autocompletion: the `numAlternatives` most likely tokens right after
+`targetPrefix`, each completed greedily, all in one decoding pass instead of a beam search. Waits for a
+replica like `generate`, and throws if rejected under load.
+-/
+def generateAlternatives (model : NativeGenerator) (input : String) (targetPrefix : String)
+    (numAlternatives : UInt64 := model.params.numReturnSequences) (maxLength : UInt64 := model.params.maxLength) :
+    IO $ Array (String × Float) := do
+  let handle ← model.getHandle
+  let tokenizer := model.tokenizer
+  let endTokens := model.params.endTokens
+  if tokenizer.native? == some .byt5 then
+    let _ ← tokenizeEndTokens endTokens tokenizer.tokenize
+    return ← FFI.byt5GenerateAlternatives handle input targetPrefix numAlternatives maxLength endTokens
+  let inputTokens := tokenizer.tokenize input |>.push tokenizer.eosToken
+  let endTokens ← tokenizeEndTokens endTokens tokenizer.tokenize
+  let tokensWithScores ← FFI.generateAlternatives handle inputTokens (tokenizer.tokenize targetPrefix) numAlternatives maxLength
+    endTokens tokenizer.eosToken
+  return tokensWithScores.map fun ((ts, s) : Array String × Float) => (tokenizer.detokenize ts, s)
+
+
+/--
+Score (input, target) pairs, e.g., known candidate tactics for goals, in one batched forward pass instead
+of searching. Each score is the probability of the target, comparable to the scores of `generate`. Waits
+for a replica like `generate`, and throws if rejected under load.
+-/
+def score (model : NativeGenerator) (pairs : Array (String × String)) : IO FloatArray := do
+  let handle ← model.getHandle
+  let (inputs, targets) := pairs.unzip
+  let tokenizer := model.tokenizer
+  if tokenizer.native? == some .byt5 then
+    return ← FFI.byt5Score handle inputs targets
+  let inputTokens := inputs.map (tokenizer.tokenize · |>.push tokenizer.eosToken)
+  FFI.score handle inputTokens (targets.map tokenizer.tokenize)
 
-  return tokensWithScores.filterMap fun ((ts, s) : Array String × Float) => (tokenizer.detokenize ts, s)
+
+def queueStats (model : NativeGenerator) : IO QueueStats := do
+  let stats ← FFI.generatorStats (← model.getHandle)
+  let get (i : Nat) := stats[i]!.toNat
+  return {
+    running := get 0, waitingInteractive := get 1, waitingSearch := get 2, waitingBackground := get 3
+    rejected := get 4, ct2QueuedBatches := get 5, ct2ActiveBatches := get 6
+  }
 
 
 instance : TextToText NativeGenerator where
-  generate := NativeGenerator.generate
+  generate model input targetPrefix := model.generate input targetPrefix
+  generateWithPrefixes model input targetPrefixes := model.generateWithPrefixes input targetPrefixes
 
 
 end NativeGenerator
@@ -93,30 +580,69 @@ end NativeGenerator
 namespace NativeEncoder
 
 
-def encode (model : NativeEncoder) (input : String) : IO FloatArray := do
-  if ¬ FFI.isEncoderInitialized model.name then
-    let path ← model.path
-    if ¬ (← path.pathExists) then
-      throw $ IO.userError s!"Cannot find the model {model.name}. Please run `lake exe download {model.url}`."
-    let device := model.device.toString
-    let computeType := model.computeType.toString
-    if ¬ (FFI.initEncoder model.name path.toString computeType device model.deviceIndex) then
-      throw $ IO.userError s!"Failed to initialize model {model.name}"
+private def warmupHandle (model : NativeEncoder) (handle : FFI.EncoderHandle) : IO Unit := do
+  FFI.warmupEncoder handle (model.tokenizer.tokenize warmupInput |>.push model.tokenizer.eosToken)
+
+
+private def getHandle (model : NativeEncoder) : IO FFI.EncoderHandle :=
+  model.getEncoderHandle fun handle => do
+    if model.warmupOnLoad then
+      model.warmupHandle handle
+
+
+/-- Like `NativeGenerator.warmup`. -/
+def warmup (model : NativeEncoder) : IO Unit := do
+  model.warmupHandle (← model.getHandle)
+
+
+/-- Like `NativeGenerator.generate`, returns an empty embedding once `cancelled` returns true. -/
+def encode (model : NativeEncoder) (input : String) (cancelled : IO Bool := IO.checkCanceled) : IO FloatArray := do
+  let handle ← model.getHandle
 
   let tokenizer := model.tokenizer
+  if tokenizer.native? == some .byt5 then
+    return ← FFI.byt5Encode handle input cancelled
+  if let some idTokenizer := tokenizer.ids? then
+    return ← FFI.encodeIds handle (idTokenizer.tokenize input |>.push idTokenizer.eosTokenId) cancelled
   let inputTokens := tokenizer.tokenize input |>.push tokenizer.eosToken
-  return FFI.encode model.name inputTokens
+  FFI.encode handle inputTokens cancelled
 
 
 instance : TextToVec NativeEncoder where
-  encode := NativeEncoder.encode
+  encode model input := model.encode input
 
 
 end NativeEncoder
 
 
+private def premiseEmbeddingsKey : String := "premise-embeddings"
+
+
+private def premiseDictionaryKey : String := "premise-dictionary"
+
+
+/-- Whether the premise embeddings are loaded. Checking counts as a use, since retrieval follows. -/
 def premiseEmbeddingsInitialized : IO Bool := do
-  return FFI.premiseEmbeddingsInitialized ()
+  touchResident premiseEmbeddingsKey
+  FFI.premiseEmbeddingsInitialized
+
+
+/--
+Load the premise embeddings unless already loaded, sharing a load in progress, e.g., from `preload`.
+Returns whether they are loaded.
+-/
+def loadPremiseEmbeddings (device : Device) : IO Bool := do
+  let path := (← getModelDir Builtin.premisesUrl) / "embeddings.npy"
+  if ¬ (← path.pathExists) then
+    return false
+  loadOnce premiseEmbeddingsKey do
+    if ← FFI.premiseEmbeddingsInitialized then
+      return
+    -- The embeddings are stored as doubles but loaded as floats.
+    reserveMemory premiseEmbeddingsKey ((← path.metadata).byteSize.toNat / 2)
+    if FFI.initPremiseEmbeddings path.toString device.toString then
+      admitResident premiseEmbeddingsKey (← FFI.premiseEmbeddingsBytes).toNat FFI.unloadPremiseEmbeddings
+  FFI.premiseEmbeddingsInitialized
 
 
 def initPremiseEmbeddings (device : Device) : Lean.CoreM Bool := do
@@ -127,11 +653,29 @@ def initPremiseEmbeddings (device : Device) : Lean.CoreM Bool := do
   if ¬ (← path.pathExists) then
     throwError s!"Please run `lake exe download {url}` to download premise embeddings."
     return false
-  return FFI.initPremiseEmbeddings path.toString device.toString
+  loadPremiseEmbeddings device
 
 
+/-- Like `premiseEmbeddingsInitialized`, but for the premise dictionary. -/
 def premiseDictionaryInitialized : IO Bool := do
-  return FFI.premiseDictionaryInitialized ()
+  touchResident premiseDictionaryKey
+  FFI.premiseDictionaryInitialized
+
+
+/-- Like `loadPremiseEmbeddings`, but for the premise dictionary. -/
+def loadPremiseDictionary : IO Bool := do
+  let path := (← getModelDir Builtin.premisesUrl) / "dictionary.json"
+  if ¬ (← path.pathExists) then
+    return false
+  loadOnce premiseDictionaryKey do
+    if ← FFI.premiseDictionaryInitialized then
+      return
+    -- Parsed JSON takes a few times the file size, so this is a lower bound.
+    let bytes := (← path.metadata).byteSize.toNat
+    reserveMemory premiseDictionaryKey bytes
+    if FFI.initPremiseDictionary path.toString then
+      admitResident premiseDictionaryKey bytes FFI.unloadPremiseDictionary
+  FFI.premiseDictionaryInitialized
 
 
 def initPremiseDictionary : IO Bool := do
@@ -139,7 +683,38 @@ def initPremiseDictionary : IO Bool := do
   if ¬ (← path.pathExists) then
     throw $ IO.userError s!"Please run `lake exe download {Builtin.premisesUrl}` to download the premise dictionary."
     return false
-  return FFI.initPremiseDictionary path.toString
+  loadPremiseDictionary
+
+
+/-- Artifacts for `preload` to load. -/
+structure PreloadConfig where
+  generators : Array NativeGenerator := #[]
+  encoders : Array NativeEncoder := #[]
+  /-- Whether to load the premise embeddings and dictionary used for premise selection. -/
+  premises : Bool := false
+  /-- Device for the premise embeddings. -/
+  device : Device := .auto
+
+
+/--
+Load `config`'s models and premise data concurrently on background threads. Calls needing one of them
+wait only for that one to finish loading instead of loading it again. Returns a task per artifact,
+e.g., to wait for all of them. Calls needing an artifact that failed to load try again.
+-/
+def preload (config : PreloadConfig) : BaseIO (Array (Task (Except IO.Error Unit))) := do
+  let mut tasks := #[]
+  for model in config.generators do
+    tasks := tasks.push (← IO.asTask (prio := .dedicated) (discard model.getHandle))
+  for model in config.encoders do
+    tasks := tasks.push (← IO.asTask (prio := .dedicated) (discard model.getHandle))
+  if config.premises then
+    tasks := tasks.push (← IO.asTask (prio := .dedicated) do
+      if ¬ (← loadPremiseEmbeddings config.device) then
+        throw $ IO.userError s!"Cannot load the premise embeddings. Please run `lake exe download {Builtin.premisesUrl}`.")
+    tasks := tasks.push (← IO.asTask (prio := .dedicated) do
+      if ¬ (← loadPremiseDictionary) then
+        throw $ IO.userError s!"Cannot load the premise dictionary. Please run `lake exe download {Builtin.premisesUrl}`.")
+  return tasks
 
 
 end LeanCopilot
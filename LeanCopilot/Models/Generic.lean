@@ -9,7 +9,8 @@ structure GenericGenerator where
   generate : String → String → IO (Array (String × Float))
 
 
-instance : TextToText GenericGenerator := ⟨GenericGenerator.generate⟩
+instance : TextToText GenericGenerator where
+  generate := GenericGenerator.generate
 
 
 structure GenericEncoder where
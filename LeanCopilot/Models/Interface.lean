@@ -5,6 +5,9 @@ namespace LeanCopilot
 
 class TextToText (τ : Type) where
   generate (model : τ) (input : String) (targetPrefix : String) : IO $ Array (String × Float)
+  /-- Generate for each of `targetPrefixes`. Models may override it to process the input only once. -/
+  generateWithPrefixes (model : τ) (input : String) (targetPrefixes : Array String) : IO $ Array (Array (String × Float)) :=
+    targetPrefixes.mapM (generate model input)
 
 
 class TextToVec (τ : Type) where
@@ -15,8 +18,62 @@ def generate {τ : Type} [TextToText τ] (model : τ) (input : String) (targetPr
   TextToText.generate model input targetPrefix
 
 
+def generateWithPrefixes {τ : Type} [TextToText τ] (model : τ) (input : String) (targetPrefixes : Array String) :
+    IO $ Array (Array (String × Float)) :=
+  TextToText.generateWithPrefixes model input targetPrefixes
+
+
 def encode {τ : Type} [TextToVec τ] (model : τ) (input : String) : IO FloatArray :=
   TextToVec.encode model input
 
 
+/-- Outputs produced one at a time, e.g., while the rest are still being generated. -/
+structure OutputStream where
+  /-- The next output, or `none` once there are no more. -/
+  next : IO (Option (String × Float))
+  /-- Whether the generation was rejected without outputs because too many others were waiting. -/
+  isBusy : Bool := false
+
+
+namespace OutputStream
+
+
+def ofArray (outputs : Array (String × Float)) : IO OutputStream := do
+  let rest ← IO.mkRef outputs.toList
+  return {next := rest.modifyGet fun | [] => (none, []) | o :: os => (some o, os)}
+
+
+def filter (stream : OutputStream) (p : String × Float → Bool) : OutputStream where
+  next := do
+    repeat
+      let some o ← stream.next | return none
+      if p o then
+        return some o
+    return none
+  isBusy := stream.isBusy
+
+
+/-- Run `f` on each output as it is read, e.g., to log them. -/
+def onNext (stream : OutputStream) (f : String × Float → IO Unit) : OutputStream where
+  next := do
+    let o? ← stream.next
+    if let some o := o? then
+      f o
+    return o?
+  isBusy := stream.isBusy
+
+
+/-- Read all remaining outputs. -/
+partial def toArray (stream : OutputStream) : IO (Array (String × Float)) :=
+  go #[]
+where
+  go (acc : Array (String × Float)) : IO (Array (String × Float)) := do
+    match ← stream.next with
+    | some o => go (acc.push o)
+    | none => return acc
+
+
+end OutputStream
+
+
 end LeanCopilot
@@ -0,0 +1,139 @@
+import Std.Data.HashMap
+
+namespace LeanCopilot
+
+set_option autoImplicit false
+
+
+/--
+Limits on the memory held by loaded native models and premise data.
+Whatever is unloaded to stay within them is loaded again on its next use.
+-/
+structure MemoryBudget where
+  /-- Total size in bytes to keep loaded, beyond which the least recently used are unloaded. `0` means unlimited. -/
+  maxBytes : Nat := 0
+  /-- Unload what has not been used for this many milliseconds. `0` keeps it loaded. -/
+  idleTimeoutMs : Nat := 0
+deriving Repr
+
+
+/-- Something loaded that counts towards the `MemoryBudget`. -/
+structure Resident where
+  bytes : Nat
+  lastUsedMs : Nat
+  /-- Drop it, so that it is freed once calls still using it return. -/
+  unload : IO Unit
+
+
+initialize memoryBudgetRef : IO.Ref MemoryBudget ← IO.mkRef {}
+
+/-- Residents by key, e.g., `generator:<NativeModel.loadKey>`. -/
+initialize residentsRef : IO.Ref (Std.HashMap String Resident) ← IO.mkRef {}
+
+initialize idleUnloaderStartedRef : IO.Ref Bool ← IO.mkRef false
+
+/-- Loads in progress by key, so that concurrent calls needing the same model wait for one load. -/
+initialize loadsRef : IO.Ref (Std.HashMap String (Task (Option (Except IO.Error Unit)))) ← IO.mkRef {}
+
+
+/--
+Run `load` unless another call is already loading `key`, in which case wait for that one instead
+and rethrow its error if any. `load` should return right away if `key` is loaded by then.
+-/
+def loadOnce (key : String) (load : IO Unit) : IO Unit := do
+  let promise : IO.Promise (Except IO.Error Unit) ← IO.Promise.new
+  let pending? ← loadsRef.modifyGet fun loads =>
+    match loads[key]? with
+    | some task => (some task, loads)
+    | none => (none, loads.insert key promise.result?)
+  if let some task := pending? then
+    let some result ← IO.wait task
+      | throw $ IO.userError s!"Loading {key} was abandoned."
+    return ← IO.ofExcept result
+  let result ← load.toBaseIO
+  loadsRef.modify (·.erase key)
+  promise.resolve result
+  IO.ofExcept result
+
+
+/-- Record a use of `key`, so that it is unloaded last. -/
+def touchResident (key : String) : IO Unit := do
+  let now ← IO.monoMsNow
+  residentsRef.modify (·.modify key ({· with lastUsedMs := now}))
+
+
+/-- Unload `key` if loaded. -/
+def unloadResident (key : String) : IO Unit := do
+  let resident? ← residentsRef.modifyGet fun rs => (rs[key]?, rs.erase key)
+  if let some r := resident? then
+    r.unload
+
+
+/--
+Unload the least recently used residents other than `key` until `bytes` more fit in the budget.
+Call it before loading `key`, so that the old and the new models are not resident at the same time.
+-/
+def reserveMemory (key : String) (bytes : Nat) : IO Unit := do
+  let maxBytes := (← memoryBudgetRef.get).maxBytes
+  if maxBytes == 0 then
+    return
+  let evicted ← residentsRef.modifyGet fun rs => Id.run do
+    let others := rs.toArray.filter (·.1 != key) |>.qsort (·.2.lastUsedMs < ·.2.lastUsedMs)
+    let mut total := others.foldl (· + ·.2.bytes) 0
+    let mut rs := rs
+    let mut evicted := #[]
+    for (k, r) in others do
+      if total + bytes ≤ maxBytes then
+        break
+      rs := rs.erase k
+      total := total - r.bytes
+      evicted := evicted.push r
+    return (evicted, rs)
+  evicted.forM (·.unload)
+
+
+/-- Account for `key` after loading it. -/
+def admitResident (key : String) (bytes : Nat) (unload : IO Unit) : IO Unit := do
+  let now ← IO.monoMsNow
+  residentsRef.modify (·.insert key {bytes, lastUsedMs := now, unload})
+
+
+/-- Unload residents unused for longer than the idle timeout. -/
+def unloadIdleResidents : IO Unit := do
+  let timeoutMs := (← memoryBudgetRef.get).idleTimeoutMs
+  if timeoutMs == 0 then
+    return
+  let now ← IO.monoMsNow
+  let isIdle (r : Resident) : Bool := now - r.lastUsedMs > timeoutMs
+  let idle ← residentsRef.modifyGet fun rs =>
+    (rs.toArray.filter (isIdle ·.2), rs.filter fun _ r => !isIdle r)
+  idle.forM (·.2.unload)
+
+
+private partial def idleUnloaderLoop : IO Unit := do
+  let timeoutMs := (← memoryBudgetRef.get).idleTimeoutMs
+  -- Check a few times per timeout, so that nothing stays loaded much longer than that.
+  let periodMs := if timeoutMs == 0 then 1000 else max 100 (min 10000 (timeoutMs / 4))
+  IO.sleep periodMs.toUInt32
+  unloadIdleResidents
+  idleUnloaderLoop
+
+
+/-- Total size in bytes of the residents. -/
+def residentBytes : IO Nat := do
+  return (← residentsRef.get).fold (fun acc _ r => acc + r.bytes) 0
+
+
+/--
+Limit the memory held by loaded models and premise data, unloading whatever exceeds the new budget.
+A nonzero idle timeout starts a background task unloading idle ones.
+-/
+def setMemoryBudget (budget : MemoryBudget) : IO Unit := do
+  memoryBudgetRef.set budget
+  reserveMemory "" 0
+  unloadIdleResidents
+  if budget.idleTimeoutMs > 0 ∧ ¬ (← idleUnloaderStartedRef.swap true) then
+    discard $ IO.asTask (prio := .dedicated) idleUnloaderLoop
+
+
+end LeanCopilot
@@ -56,18 +56,68 @@ def ComputeType.toString : ComputeType → String
 instance : ToString ComputeType := ⟨ComputeType.toString⟩
 
 
+/-- Whether weights are int8, which `lake exe download --int8` can quantize ahead of time. -/
+def ComputeType.isInt8 : ComputeType → Bool
+  | .int8 | .int8_float32 | .int8_float16 | .int8_bfloat16 => true
+  | _ => false
+
+
+/--
+Tokenizers implemented natively in `cpp/ct2.cpp`. Models using them pass raw strings through FFI
+instead of calling `Tokenizer.tokenize` and `Tokenizer.detokenize` in Lean.
+-/
+inductive NativeTokenizer where
+  | byt5
+deriving Repr, BEq
+
+
+/--
+A tokenizer producing the model's token ids directly. Ids are passed through FFI as integers,
+skipping the round trip through token strings.
+-/
+structure IdTokenizer where
+  tokenize : String → Array UInt32
+  detokenize : Array UInt32 → String
+  eosTokenId : UInt32
+
+
 structure Tokenizer where
   tokenize : String → Array String
   detokenize : Array String → String
   eosToken : String
+  native? : Option NativeTokenizer := none
+  ids? : Option IdTokenizer := none
 
 
+/--
+A model run locally by ctranslate2. `interThreads` replicas of the model serve requests in parallel,
+each using `intraThreads` threads, e.g., 4 × 4 favors throughput on build servers and 1 × 16 favors
+latency in editors.
+-/
 structure NativeModel where
   url : Url
   device : Device := .auto
   deviceIndex : Array UInt64 := #[0]
   computeType : ComputeType := .default
   tokenizer : Tokenizer
+  /-- Number of replicas per device. -/
+  interThreads : UInt64 := 1
+  /-- Number of threads per replica. `0` uses ctranslate2's default. -/
+  intraThreads : UInt64 := 0
+  /-- Maximum number of batches waiting for a replica. `0` picks a limit automatically and `-1` means unlimited. -/
+  maxQueuedBatches : Int64 := 0
+  /-- Pin the threads to consecutive CPU cores starting from this one. `-1` disables pinning. -/
+  cpuCoreOffset : Int64 := -1
+  /--
+  Maximum number of generations waiting for a replica, beyond which more are rejected as busy instead of
+  piling up. `0` means unlimited. Ignored by encoders.
+  -/
+  maxWaitingRequests : UInt64 := 0
+  /--
+  Warm the model up once loaded, see `NativeGenerator.warmup`. It makes loading slower but the first
+  call as fast as the following ones.
+  -/
+  warmupOnLoad : Bool := false
 
 
 def NativeModel.name (model : NativeModel) : String := model.url.name!
@@ -77,6 +127,16 @@ def NativeModel.path (model : NativeModel) : IO FilePath :=
   getModelDir model.url
 
 
+/--
+A syntactic constraint on generated tactics, checked by a byte-level automaton in `cpp/ct2.cpp`:
+brackets must be balanced outside of string and character literals and comments, and the first word
+must be one of `keywords` unless it is empty. Only supported by the native ByT5 tokenizer.
+-/
+structure SyntaxConstraint where
+  keywords : Array String := #[]
+deriving Repr
+
+
 structure BeamSearchParams where
   numReturnSequences : UInt64
   beamSize : UInt64 := numReturnSequences
@@ -85,9 +145,49 @@ structure BeamSearchParams where
   lengthPenalty : Float := 0.0
   patience : Float := 2.0
   temperature : Float := 1.0
+  /-- Sample from the `samplingTopK` most likely tokens, or from all tokens if `0`. `1` decodes greedily. -/
+  samplingTopK : UInt64 := 0
+  /--
+  Texts at which decoding stops besides the EOS token, e.g., `#["\n"]` for single-line tactics.
+  Each must be a single token of the model's tokenizer, i.e., a single byte for ByT5.
+  -/
+  endTokens : Array String := #[]
+  /-- Texts masked during beam search so that they never appear in outputs. -/
+  suppressedSequences : Array String := #[]
+  /-- Texts masked right before decoding stops so that no output ends with them, e.g., `#["sorry"]`. -/
+  suppressedEndings : Array String := #[]
+  /--
+  Drop outputs not satisfying the constraint, so that fewer of them fail to parse. It filters finished
+  outputs rather than masking bytes while decoding, so it decodes no more than without it but may return
+  fewer than `numReturnSequences` outputs.
+  -/
+  syntaxConstraint? : Option SyntaxConstraint := none
+  /--
+  Merge outputs differing only in whitespace, adding up their scores, so that fewer than `numReturnSequences`
+  outputs may be returned. Only supported by the native ByT5 tokenizer.
+  -/
+  deduplicate : Bool := false
 deriving Repr
 
 
+/--
+Priority classes of native generations. When requests wait for a replica, higher classes go first, and
+with several replicas, one is reserved for interactive requests, so that a proof search saturating the
+others does not delay suggestions in the editor.
+-/
+inductive Priority where
+  | interactive
+  | search
+  | background
+deriving Repr, BEq
+
+
+def Priority.toUInt8 : Priority → UInt8
+  | .interactive => 0
+  | .search => 1
+  | .background => 2
+
+
 structure NativeGenerator extends NativeModel where
   params : BeamSearchParams
 
@@ -25,6 +25,17 @@ instance : TextToText Generator where
     | .native ng => ng.generate input targetPrefix
     | .external eg => eg.generate input targetPrefix
     | .generic gg => gg.generate input targetPrefix
+  generateWithPrefixes (model : Generator) (input : String) (targetPrefixes : Array String) :=
+    match model with
+    | .native ng => LeanCopilot.generateWithPrefixes ng input targetPrefixes
+    | .external eg => LeanCopilot.generateWithPrefixes eg input targetPrefixes
+    | .generic gg => LeanCopilot.generateWithPrefixes gg input targetPrefixes
+
+
+/-- Warm up native generators, see `NativeGenerator.warmup`. Other generators have nothing to warm up. -/
+def Generator.warmup : Generator → IO Unit
+  | .native ng => ng.warmup
+  | _ => return ()
 
 
 inductive Encoder where
@@ -41,6 +52,11 @@ instance : TextToVec Encoder where
     | .generic ge => ge.encode input
 
 
+def Encoder.warmup : Encoder → IO Unit
+  | .native ne => ne.warmup
+  | _ => return ()
+
+
 instance {α β : Type} [BEq α] [Hashable α] [Repr α] [Repr β] : Repr (Std.HashMap α β) where
   reprPrec hm n := reprPrec hm.toList n
 
@@ -108,4 +124,21 @@ def registerGenerator (name : String) (model : Generator) := do
     {mr with generators := mr.generators.insert name model}
 
 
+/-- Preload the registered native models and, if `premises`, the premise data, see `preload`. -/
+def preloadRegistered (premises : Bool := true) : IO (Array (Task (Except IO.Error Unit))) := do
+  let mr ← getModelRegistry
+  preload {
+    generators := mr.generators.toArray.filterMap fun | (_, .native ng) => some ng | _ => none
+    encoders := mr.encoders.toArray.filterMap fun | (_, .native ne) => some ne | _ => none
+    premises
+  }
+
+
+-- Setting `LEAN_COPILOT_PRELOAD=1` starts loading everything at `import LeanCopilot`. Errors, e.g., for models
+-- not downloaded yet, are left to the calls needing them.
+initialize
+  if (← IO.getEnv "LEAN_COPILOT_PRELOAD") == some "1" then
+    discard preloadRegistered
+
+
 end LeanCopilot
@@ -50,6 +50,18 @@ def getGeneratorName : m String := do
   | _ => return Builtin.generator.name
 
 
+register_option LeanCopilot.suggest_tactics.deadline_ms : Nat := {
+  defValue := 0
+  descr := "Milliseconds after which native generators stop decoding and return what they have, or 0 for no deadline."
+}
+
+
+def getDeadlineMs : m Nat := do
+  match LeanCopilot.suggest_tactics.deadline_ms.get? (← getOptions) with
+  | some n => return n
+  | _ => return 0
+
+
 end SuggestTactics
 
 
@@ -31,6 +31,80 @@ def getPpTacticState : TacticM String := do
   ppTacticState goals
 
 
+/--
+The name of the current theorem without namespaces, or `""` for examples.
+-/
+def getTheoremName (declName? : Option Name) : String :=
+  match declName?.map (·.toString) with
+  | none | some "_example" => ""
+  | some n => n.splitOn "." |>.getLast!
+
+
+/--
+Mask tactics referring to the current theorem during beam search. `aesop` is only filtered afterwards,
+since masking it as an ending would also drop tactics such as `simp <;> aesop`.
+-/
+private def suppressTactics (ng : NativeGenerator) (theoremName : String) : NativeGenerator :=
+  if theoremName == "" then
+    ng
+  else
+    {ng with params := {ng.params with suppressedSequences := ng.params.suppressedSequences.push theoremName}}
+
+
+/--
+Whether a tactic is neither `aesop` nor referring to the current theorem.
+A temporary workaround to prevent the tactic from using the current theorem.
+TODO: Use a more principled way, e.g., see `Lean4Repl.lean` in `LeanDojo`.
+-/
+private def isUsableTactic (theoremName : String) (t : String) : Bool :=
+  let isAesop := t == "aesop"
+  let isSelfReference := ¬ (theoremName == "") ∧ (String.Matcher.ofString theoremName |>.find? t |>.isSome)
+  ¬ (isSelfReference ∨ isAesop)
+
+
+/--
+Generate tactics that are neither `aesop` nor referring to the current theorem.
+Native generators mask the latter during beam search, so that fewer returned sequences are dropped.
+Other generators' outputs, and `aesop` alone, are filtered afterwards.
+Native generators also stop decoding once `cancelled` returns true, returning no tactics,
+or after `deadlineMs` milliseconds if nonzero, returning partial results. `priority` orders the calls
+waiting for a replica, e.g., proof search yields to suggestions in the editor.
+-/
+def generateTactics (model : Generator) (state : String) (targetPrefix : String) (theoremName : String)
+    (cancelled : IO Bool := IO.checkCanceled) (deadlineMs : UInt64 := 0) (priority : Priority := .interactive) :
+    IO GenerationResult := do
+  let result ← match model with
+    | .native ng => (suppressTactics ng theoremName).generateWithDeadline state targetPrefix deadlineMs cancelled priority
+    | _ => pure {outputs := ← generate model state targetPrefix}
+  return {result with outputs := result.outputs.filter (isUsableTactic theoremName ·.1)}
+
+
+/--
+Like `generateTactics`, but returning tactics as soon as they are generated, see `NativeGenerator.generateStream`.
+Other generators return all tactics at once.
+-/
+def streamTactics (model : Generator) (state : String) (targetPrefix : String) (theoremName : String)
+    (cancelled : IO Bool := IO.checkCanceled) : IO OutputStream := do
+  let stream ← match model with
+    | .native ng => (suppressTactics ng theoremName).generateStream state targetPrefix cancelled
+    | _ => .ofArray (← generate model state targetPrefix)
+  return stream.filter (isUsableTactic theoremName ·.1)
+
+
+/--
+Whether Lean aborted the current elaboration, e.g., because the user kept typing,
+after which there is no point in decoding further.
+-/
+def getCancelled : CoreM (IO Bool) := do
+  let cancelTk? := (← read).cancelTk?
+  return do
+    if ← IO.checkCanceled then
+      return true
+    match cancelTk? with
+    | some tk => tk.isSet
+    | none => return false
+
+
 open SuggestTactics in
 /--
 Generate a list of tactic suggestions.
@@ -39,27 +113,48 @@ def suggestTactics (targetPrefix : String) : TacticM (Array (String × Float)) :
   let state ← getPpTacticState
   let nm ← getGeneratorName
   let model ← getGenerator nm
-  let suggestions ← generate model state targetPrefix
-  -- A temporary workaround to prevent the tactic from using the current theorem.
-  -- TODO: Use a more principled way, e.g., see `Lean4Repl.lean` in `LeanDojo`.
-  if let some declName ← getDeclName? then
-    let theoremName := match declName.toString with
-      | "_example" => ""
-      | n => n.splitOn "." |>.getLast!
-    let theoremNameMatcher := String.Matcher.ofString theoremName
-    if ← isVerbose then
-      logInfo s!"State:\n{state}"
-      logInfo s!"Theorem name:\n{theoremName}"
-    let filteredSuggestions := suggestions.filterMap fun ((t, s) : String × Float) =>
-      let isAesop := t == "aesop"
-      let isSelfReference := ¬ (theoremName == "") ∧ (theoremNameMatcher.find? t |>.isSome)
-      if isSelfReference ∨ isAesop then none else some (t, s)
-    return filteredSuggestions
-  else
-    let filteredSuggestions := suggestions.filterMap fun ((t, s) : String × Float) =>
-      let isAesop := t == "aesop"
-      if isAesop then none else some (t, s)
-    return filteredSuggestions
+  let theoremName := getTheoremName (← getDeclName?)
+  if ← isVerbose then
+    logInfo s!"State:\n{state}"
+    logInfo s!"Theorem name:\n{theoremName}"
+  let cancelled ← getCancelled
+  let deadlineMs ← getDeadlineMs
+  let result ← generateTactics model state targetPrefix theoremName cancelled deadlineMs.toUInt64
+  Core.checkInterrupted
+  if result.isBusy then
+    logInfo s!"{nm} is busy, so no tactics are suggested. Try again later."
+  if result.isPartial then
+    logInfo s!"Decoding stopped after {deadlineMs}ms, so some suggestions may be unfinished."
+  return result.outputs
+
+
+open SuggestTactics in
+/--
+Generate tactic suggestions one at a time, as soon as they are generated.
+-/
+def streamSuggestedTactics (targetPrefix : String) : TacticM OutputStream := do
+  let state ← getPpTacticState
+  let nm ← getGeneratorName
+  let model ← getGenerator nm
+  let theoremName := getTheoremName (← getDeclName?)
+  if ← isVerbose then
+    logInfo s!"State:\n{state}"
+    logInfo s!"Theorem name:\n{theoremName}"
+  let stream ← streamTactics model state targetPrefix theoremName (← getCancelled)
+  if stream.isBusy then
+    logInfo s!"{nm} is busy, so no tactics are suggested. Try again later."
+  return stream
+
+
+open SuggestTactics in
+/--
+Whether the generator returns tactics as soon as each is decoded, which native greedy decoding and sampling
+do with the ByT5 tokenizer. Beam search returns them all at once.
+-/
+private def streamsTactics : TacticM Bool := do
+  match ← getGenerator (← getGeneratorName) with
+  | .native ng => return ng.params.beamSize == 1 ∧ ng.tokenizer.native? == some .byt5
+  | _ => return false
 
 
 /--
@@ -90,18 +185,25 @@ private def annotatePremise (pi : PremiseInfo) : MetaM String := do
 Retrieve a list of premises given a query.
 -/
 def retrieve (input : String) : TacticM (Array PremiseInfo) := do
+  -- Load the dictionary if needed while the embeddings are loaded and the query is encoded.
+  let dictionary? ← if ← premiseDictionaryInitialized then
+    pure none
+  else
+    some <$> IO.asTask (prio := .dedicated) initPremiseDictionary
+
   if ¬ (← premiseEmbeddingsInitialized) ∧ ¬ (← initPremiseEmbeddings .auto) then
     throwError "Cannot initialize premise embeddings"
 
-  if ¬ (← premiseDictionaryInitialized) ∧ ¬ (← initPremiseDictionary) then
-    throwError "Cannot initialize premise dictionary"
-
   let k ← SelectPremises.getNumPremises
   let query ← encode Builtin.encoder input
 
-  let rawPremiseInfo := FFI.retrieve query k.toUInt64
-  let premiseInfo : Array PremiseInfo := rawPremiseInfo.map fun (name, path, code, score) =>
-    { name := name, path := path, code := code, score := score }
+  if let some dictionary := dictionary? then
+    if ¬ (← IO.ofExcept (← IO.wait dictionary)) then
+      throwError "Cannot initialize premise dictionary"
+
+  let packed := FFI.retrievePacked query k.toUInt64
+  let premiseInfo : Array PremiseInfo := (Array.range packed.size).map fun i =>
+    { name := packed.string! (3 * i), path := packed.string! (3 * i + 1), code := packed.string! (3 * i + 2), score := packed.scores.get! i }
   return premiseInfo
 
 
@@ -128,15 +230,28 @@ elab_rules : tactic
     logInfo state
 
   | `(tactic | suggest_tactics%$tac $pfx:str) => do
+    let range : Lean.Syntax.Range := { start := tac.getRange?.get!.start, stop := pfx.raw.getRange?.get!.stop }
+    let ref := Syntax.ofRange range
+    let check ← SuggestTactics.checkTactics
+    -- Check tactics while the rest are still being generated, unless the deadline asks for all of them at once.
+    if check ∧ (← SuggestTactics.getDeadlineMs) == 0 ∧ (← streamsTactics) then
+      let generated ← IO.mkRef (#[] : Array String)
+      let ((), elapsed) ← Aesop.time do
+        let stream ← streamSuggestedTactics pfx.getString
+        hint ref (stream.onNext fun (t, _) => generated.modify (·.push t)) true
+      Core.checkInterrupted
+      if ← isVerbose then
+        let tactics ← generated.get
+        logInfo s!"{elapsed.printAsMillis} for generating and checking {tactics.size} tactics"
+        logInfo s!"Tactics: {tactics}"
+      return
     let (tacticsWithScores, elapsed) ← Aesop.time $ suggestTactics pfx.getString
     if ← isVerbose then
       logInfo s!"{elapsed.printAsMillis} for generating {tacticsWithScores.size} tactics"
     let tactics := tacticsWithScores.map (·.1)
     if ← isVerbose then
       logInfo s!"Tactics: {tactics}"
-    let range : Lean.Syntax.Range := { start := tac.getRange?.get!.start, stop := pfx.raw.getRange?.get!.stop }
-    let ref := Syntax.ofRange range
-    hint ref tactics (← SuggestTactics.checkTactics)
+    hint ref (← OutputStream.ofArray tacticsWithScores) check
 
   | `(tactic | select_premises) => do
     let premisesWithInfoAndScores ← selectPremises
@@ -25,6 +25,81 @@ def reprover' : NativeGenerator := {reprover with
 
 #eval generate reprover' "n : ℕ\n⊢ gcd n n = n"
 
+-- Beams stop at the end of their first line.
+def reproverSingleLine : NativeGenerator := {reprover' with
+  params := {reprover'.params with endTokens := #["\n"]}
+}
+
+#eval generate reproverSingleLine "n : ℕ\n⊢ gcd n n = n"
+
+-- After warming up, the first call is as fast as the following ones.
+#eval show IO _ from do
+  reprover.warmup
+  let start ← IO.monoMsNow
+  let _ ← generate reprover "n : ℕ\n⊢ gcd n n = n"
+  return s!"{(← IO.monoMsNow) - start}ms"
+
+#eval show IO _ from do
+  let packed ← reprover'.generatePacked "n : ℕ\n⊢ gcd n n = n" ""
+  return (packed.size, packed.string! 0, packed.scores.get! 0)
+
+-- Outputs arrive one at a time; beam search returns them once it completes.
+#eval show IO _ from do
+  let stream ← reprover'.generateStream "n : ℕ\n⊢ gcd n n = n" ""
+  stream.toArray
+
+#eval generateWithPrefixes reprover' "n : ℕ\n⊢ gcd n n = n" #["rw [", "simp [", "apply "]
+
+#eval reprover'.generateAlternatives "n : ℕ\n⊢ gcd n n = n" "rw [" (numAlternatives := 8)
+
+#eval reprover.score #[("n : ℕ\n⊢ gcd n n = n", "simp"), ("n : ℕ\n⊢ gcd n n = n", "rw [gcd_self]"), ("n : ℕ\n⊢ gcd n n = n", "ring")]
+
+-- Typing "simp" character by character only decodes when the cached completions run out.
+#eval show IO _ from do
+  let session ← CompletionSession.new reprover' "n : ℕ\n⊢ gcd n n = n" (minResults? := some 2)
+  ["", "s", "si", "sim", "simp"].mapM session.complete
+
+def reproverDedup : NativeGenerator := {reprover with
+  params := {numReturnSequences := 8, deduplicate := true}
+}
+
+#eval generate reproverDedup "n : ℕ\n⊢ gcd n n = n"
+
+-- Identical concurrent calls without sampling share one beam search and get the same outputs.
+def reproverDeterministic : NativeGenerator := {reprover' with
+  params := {reprover'.params with samplingTopK := 1}
+}
+
+#eval show IO _ from do
+  let tasks ← (List.range 4).mapM fun _ => IO.asTask (generate reproverDeterministic "n : ℕ\n⊢ gcd n n = n")
+  let outputs ← tasks.mapM fun t => IO.ofExcept t.get
+  return outputs.all (· == outputs.head!)
+
+-- Background calls wait for interactive ones when both need a replica.
+#eval show IO _ from do
+  let background ← IO.asTask (reprover'.generate "n : ℕ\n⊢ gcd n n = n" "simp" (priority := .background))
+  let interactive ← reprover'.generate "n : ℕ\n⊢ gcd n n = n" "rw ["
+  return (interactive, ← IO.ofExcept background.get)
+
+-- With at most one waiting call, some of these are rejected as busy instead of queueing up.
+def reproverBounded : NativeGenerator := {reprover' with maxWaitingRequests := 1}
+
+#eval show IO _ from do
+  let tasks ← (List.range 4).mapM fun i =>
+    IO.asTask (reproverBounded.generateWithDeadline "n : ℕ\n⊢ gcd n n = n" s!"{i}" 0)
+  let results ← tasks.mapM fun t => IO.ofExcept t.get
+  return (results.map (·.isBusy), ← reproverBounded.queueStats)
+
+-- A cancelled generation returns right away without outputs.
+#eval reprover'.generate "n : ℕ\n⊢ gcd n n = n" "" (cancelled := return true)
+
+-- Skip the native ByT5 tokenizer to exercise the id-based FFI.
+def reproverIds : NativeGenerator := {reprover with
+  tokenizer := {ByT5.tokenizer with native? := none}
+}
+
+#eval generate reproverIds "n : ℕ\n⊢ gcd n n = n"
+
 
 /--
 The original ByT5 checkpoint in CT2 format.
@@ -40,6 +115,14 @@ def byt5 : NativeGenerator := {
 #eval generate byt5 "Hello, world!"
 
 
+def greedyReprover : NativeGenerator := {reprover with
+  params := {numReturnSequences := 1, beamSize := 1, samplingTopK := 1}
+}
+
+-- Greedy decoding returns the tokens decoded so far once the deadline passes.
+#eval greedyReprover.generateWithDeadline "n : ℕ\n⊢ gcd n n = n" "" (deadlineMs := 1)
+
+
 /--
 ReProver's retriever encoder in CT2 format.
 -/
@@ -50,6 +133,29 @@ def reproverEncoder : NativeEncoder := {
 
 #eval encode reproverEncoder "n : ℕ\n⊢ gcd n n = n"
 
+-- Preloading runs in the background. Calls wait for the load in progress instead of loading again.
+#eval show IO _ from do
+  reproverEncoder.unload
+  let tasks ← preload {encoders := #[reproverEncoder]}
+  let embedding ← encode reproverEncoder "n : ℕ\n⊢ gcd n n = n"
+  tasks.forM fun t => IO.ofExcept t.get
+  return embedding.size
+
+-- Unloading frees the model, which is loaded again on the next call.
+#eval reproverEncoder.unload
+
+#eval encode reproverEncoder "n : ℕ\n⊢ gcd n n = n"
+
+-- With room for only one model, loading the encoder unloads the generator, which is loaded again on its next call.
+#eval show IO _ from do
+  setMemoryBudget {maxBytes := 1}
+  let _ ← generate reprover' "n : ℕ\n⊢ gcd n n = n"
+  let _ ← encode reproverEncoder "n : ℕ\n⊢ gcd n n = n"
+  let resident := (← residentsRef.get).keys
+  let outputs ← generate reprover' "n : ℕ\n⊢ gcd n n = n"
+  setMemoryBudget {}
+  return (resident, outputs)
+
 
 /--
 Arbitrary generator you can define.
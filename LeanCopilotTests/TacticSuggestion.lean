@@ -58,6 +58,19 @@ example (a b c : Nat) : a + b + c = a + c + b := by
   try sorry
 
 
+-- Only return tactics with balanced brackets.
+def constrainedModel := {Builtin.generator with
+  params := {Builtin.generator.params with syntaxConstraint? := some {}}
+}
+
+#eval registerGenerator "constrainedModel" (.native constrainedModel)
+
+
+set_option LeanCopilot.suggest_tactics.model "constrainedModel" in
+example (a b c : Nat) : a + b + c = a + c + b := by
+  suggest_tactics
+
+
 /-
 ### Bring Your Own Model
 
@@ -1,2 +1,3 @@
 import ModelCheckpointManager.Url
 import ModelCheckpointManager.Download
+import ModelCheckpointManager.Quantize
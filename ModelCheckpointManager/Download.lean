@@ -48,6 +48,11 @@ def getModelDir (url : Url) : IO FilePath := do
   return (← getCacheDir) / url.hostname / url.path |>.normalize
 
 
+/-- Where `lake exe download --int8` stores the model with its weights quantized to int8 ahead of time. -/
+def getQuantizedModelDir (url : Url) : IO FilePath := do
+  return s!"{← getModelDir url}-int8"
+
+
 def isUpToDate (url : Url) : IO Bool := do
   let dir := ← getModelDir url
   if ¬ (← dir.pathExists) then
@@ -92,6 +97,9 @@ def downloadUnlessUpToDate (url : Url) : IO Unit := do
   println! s!"Downloading the model into {dir}"
   if ← dir.pathExists then
     IO.FS.removeDirAll dir
+  let quantizedDir ← getQuantizedModelDir url
+  if ← quantizedDir.pathExists then
+    IO.FS.removeDirAll quantizedDir
   let some parentDir := dir.parent | unreachable!
   IO.FS.createDirAll parentDir
 
@@ -1,5 +1,6 @@
 import ModelCheckpointManager.Url
 import ModelCheckpointManager.Download
+import ModelCheckpointManager.Quantize
 
 open LeanCopilot
 
@@ -12,12 +13,21 @@ def builtinModelUrls : List String := [
 ]
 
 
+/--
+`lake exe download [--int8] [url ...]` downloads the built-in models or the given ones. With `--int8`,
+it also stores their weights quantized to int8, which native models with int8 compute types then load.
+-/
 def main (args : List String) : IO Unit := do
   let mut tasks := #[]
+  let int8 := args.contains "--int8"
+  let args := args.filter (· != "--int8")
   let urls := Url.parse! <$> (if args.isEmpty then builtinModelUrls else args)
 
   for url in urls do
-    tasks := tasks.push $ ← IO.asTask $ downloadUnlessUpToDate url
+    tasks := tasks.push $ ← IO.asTask do
+      downloadUnlessUpToDate url
+      if int8 then
+        quantizeUnlessExists url
 
   for t in tasks do
     match ← IO.wait t with
@@ -0,0 +1,224 @@
+import ModelCheckpointManager.Download
+
+set_option autoImplicit false
+
+open System (FilePath)
+
+namespace LeanCopilot
+
+/-!
+Quantize the linear weights in ctranslate2's `model.bin` to int8 ahead of time, so that loading
+the model with an int8 compute type neither converts them nor holds the float32 copy at the same time.
+
+`model.bin` stores a little-endian binary version, the spec name and revision, then the variables,
+each with its name, shape, data type, and data, and finally aliases between variables. Strings are
+prefixed with their length, which counts their null terminator. A quantized weight is stored as int8
+with per-row scales in `<name>_scale`, such that the original row is the int8 row divided by its scale,
+which is what ctranslate2 itself produces. Variables left as they are, e.g., embeddings, are still
+converted by ctranslate2 when loading if needed.
+-/
+
+namespace Quantize
+
+
+private structure Variable where
+  name : String
+  shape : Array Nat
+  dtype : UInt8
+  numBytes : Nat
+
+
+/-- ctranslate2's `DataType` ids. -/
+private def float32 : UInt8 := 0
+private def int8 : UInt8 := 1
+
+
+private def itemSize? : UInt8 → Option Nat
+  | 0 => some 4  -- float32
+  | 1 => some 1  -- int8
+  | 2 => some 2  -- int16
+  | 3 => some 4  -- int32
+  | 4 => some 2  -- float16
+  | 5 => some 2  -- bfloat16
+  | _ => none
+
+
+private partial def readExact (h : IO.FS.Handle) (n : Nat) : IO ByteArray :=
+  go .empty
+where
+  go (acc : ByteArray) : IO ByteArray := do
+    if acc.size ≥ n then
+      return acc
+    let chunk ← h.read (n - acc.size).toUSize
+    if chunk.isEmpty then
+      throw $ IO.userError "Unexpected end of model.bin."
+    go (acc ++ chunk)
+
+
+private def getUInt32 (b : ByteArray) (i : Nat) : UInt32 :=
+  b[i]!.toUInt32 ||| (b[i + 1]!.toUInt32 <<< 8) ||| (b[i + 2]!.toUInt32 <<< 16) ||| (b[i + 3]!.toUInt32 <<< 24)
+
+
+private def uint32Bytes (v : UInt32) : ByteArray :=
+  ⟨#[v.toUInt8, (v >>> 8).toUInt8, (v >>> 16).toUInt8, (v >>> 24).toUInt8]⟩
+
+
+private def readUInt32 (h : IO.FS.Handle) : IO Nat := do
+  return getUInt32 (← readExact h 4) 0 |>.toNat
+
+
+/-- Read a string, returning it with its serialized bytes. -/
+private def readString (h : IO.FS.Handle) : IO (String × ByteArray) := do
+  let lengthBytes ← readExact h 2
+  let length := lengthBytes[0]!.toNat + lengthBytes[1]!.toNat * 256
+  let bytes ← readExact h length
+  let some s := String.fromUTF8? (bytes.extract 0 (length - 1))
+    | throw $ IO.userError "Invalid string in model.bin."
+  return (s, lengthBytes ++ bytes)
+
+
+private def stringBytes (s : String) : ByteArray :=
+  let bytes := s.toUTF8.push 0
+  ⟨#[bytes.size.toUInt8, (bytes.size / 256).toUInt8]⟩ ++ bytes
+
+
+/-- The binary version, spec name, and spec revision, serialized. -/
+private def readHeader (h : IO.FS.Handle) : IO ByteArray := do
+  let versionBytes ← readExact h 4
+  let version := getUInt32 versionBytes 0
+  -- Earlier versions store item sizes instead of data types.
+  if version < 4 ∨ version > 6 then
+    throw $ IO.userError s!"Unsupported model.bin version {version}."
+  let (_, spec) ← readString h
+  return versionBytes ++ spec ++ (← readExact h 4)
+
+
+/-- Read a variable's metadata, returning it with its serialized bytes. -/
+private def readVariable (h : IO.FS.Handle) : IO (Variable × ByteArray) := do
+  let (name, nameBytes) ← readString h
+  let rankBytes ← readExact h 1
+  let rank := rankBytes[0]!.toNat
+  let dimBytes ← readExact h (4 * rank)
+  let shape := (Array.range rank).map fun i => (getUInt32 dimBytes (4 * i)).toNat
+  let typeBytes ← readExact h 5
+  let dtype := typeBytes[0]!
+  let numBytes := (getUInt32 typeBytes 1).toNat
+  let some itemSize := itemSize? dtype
+    | throw $ IO.userError s!"Unknown data type {dtype} of {name} in model.bin."
+  if numBytes != itemSize * shape.foldl (· * ·) 1 then
+    throw $ IO.userError s!"Inconsistent size of {name} in model.bin."
+  return ({name, shape, dtype, numBytes}, nameBytes ++ rankBytes ++ dimBytes ++ typeBytes)
+
+
+private def variableBytes (name : String) (shape : Array Nat) (dtype : UInt8) (numBytes : Nat) : ByteArray :=
+  shape.foldl (· ++ uint32Bytes ·.toUInt32) (stringBytes name ++ ⟨#[shape.size.toUInt8]⟩)
+    ++ ⟨#[dtype]⟩ ++ uint32Bytes numBytes.toUInt32
+
+
+/-- The variables and the names aliases refer to, checking that nothing follows them. -/
+private def readLayout (path : FilePath) : IO (Array Variable × Array String) := do
+  let h ← IO.FS.Handle.mk path .read
+  let _ ← readHeader h
+  let numVariables ← readUInt32 h
+  let mut variables := #[]
+  for _ in [0:numVariables] do
+    let (v, _) ← readVariable h
+    let _ ← readExact h v.numBytes
+    variables := variables.push v
+  let numAliases ← readUInt32 h
+  let mut aliased := #[]
+  for _ in [0:numAliases] do
+    let _ ← readString h
+    aliased := aliased.push (← readString h).1
+  if ¬ (← h.readBinToEnd).isEmpty then
+    throw $ IO.userError "Unexpected data at the end of model.bin."
+  return (variables, aliased)
+
+
+/--
+Whether to quantize `v`, which is a float32 weight of a linear layer. Embeddings are left to ctranslate2,
+and so are weights aliased by others or already quantized.
+-/
+private def isQuantizable (variables : Array Variable) (aliased : Array String) (v : Variable) : Bool :=
+  v.dtype == float32 ∧ v.shape.size == 2 ∧ v.name.endsWith "weight" ∧ (v.name.splitOn "embeddings").length == 1 ∧
+    ¬ aliased.contains v.name ∧ ¬ variables.any (·.name == v.name ++ "_scale")
+
+
+private def getFloat32 (b : ByteArray) (i : Nat) : Float :=
+  (Float32.ofBits (getUInt32 b i)).toFloat
+
+
+/-- Round `x` to the nearest int8 in two's complement. -/
+private def toInt8Byte (x : Float) : UInt8 :=
+  let x := max (-127) (min 127 x.round)
+  if x ≥ 0 then x.toUInt8 else 0 - (-x).toUInt8
+
+
+/-- Quantize each row of a `rows × cols` float32 matrix, returning the int8 matrix and the float32 scales. -/
+private def quantizeRows (data : ByteArray) (rows cols : Nat) : ByteArray × ByteArray := Id.run do
+  let mut q := ByteArray.empty
+  let mut scales := ByteArray.empty
+  for r in [0:rows] do
+    let offset := 4 * r * cols
+    let mut amax : Float := 0
+    for c in [0:cols] do
+      amax := max amax (getFloat32 data (offset + 4 * c)).abs
+    let scale : Float := if amax == 0 then 1 else 127 / amax
+    for c in [0:cols] do
+      q := q.push (toInt8Byte (getFloat32 data (offset + 4 * c) * scale))
+    scales := scales ++ uint32Bytes scale.toFloat32.toBits
+  return (q, scales)
+
+
+/-- Write `src` with its linear weights quantized to `dst`. -/
+def quantizeModelFile (src dst : FilePath) : IO Unit := do
+  let (variables, aliased) ← readLayout src
+  let quantizable := variables.filter (isQuantizable variables aliased)
+  let input ← IO.FS.Handle.mk src .read
+  let output ← IO.FS.Handle.mk dst .write
+  output.write (← readHeader input)
+  let _ ← readExact input 4
+  output.write (uint32Bytes (variables.size + quantizable.size).toUInt32)
+  for _ in variables do
+    let (v, bytes) ← readVariable input
+    let data ← readExact input v.numBytes
+    if ¬ quantizable.any (·.name == v.name) then
+      output.write (bytes ++ data)
+      continue
+    let rows := v.shape[0]!
+    let (q, scales) := quantizeRows data rows v.shape[1]!
+    output.write (variableBytes v.name v.shape int8 q.size ++ q)
+    output.write (variableBytes (v.name ++ "_scale") #[rows] float32 scales.size ++ scales)
+  -- The aliases are unchanged.
+  output.write (← input.readBinToEnd)
+  output.flush
+
+
+end Quantize
+
+
+/--
+Write the model downloaded from `url` with its weights quantized to int8 into `getQuantizedModelDir`,
+unless it is there already. Native models with int8 compute types load it instead of converting the
+weights at every start. Does nothing for downloads other than ctranslate2 models.
+-/
+def quantizeUnlessExists (url : Url) : IO Unit := do
+  let srcDir ← getModelDir url
+  let dstDir ← getQuantizedModelDir url
+  if ¬ (← (srcDir / "model.bin").pathExists) ∨ (← dstDir.pathExists) then
+    return
+  println! s!"Quantizing the model into {dstDir}"
+  -- Build it next to its destination, so that a partial one is never used.
+  let tmpDir : FilePath := s!"{dstDir}.tmp"
+  if ← tmpDir.pathExists then
+    IO.FS.removeDirAll tmpDir
+  IO.FS.createDirAll tmpDir
+  for entry in ← srcDir.readDir do
+    if entry.fileName == "model.bin" ∨ entry.fileName.startsWith "." ∨ (← entry.path.isDir) then
+      continue
+    IO.FS.writeBinFile (tmpDir / entry.fileName) (← IO.FS.readBinFile entry.path)
+  Quantize.quantizeModelFile (srcDir / "model.bin") (tmpDir / "model.bin")
+  IO.FS.rename tmpDir dstDir
+
+
+end LeanCopilot
@@ -1,15 +1,31 @@
 #include <ctranslate2/devices.h>
 #include <ctranslate2/encoder.h>
+#include <ctranslate2/models/model.h>
 #include <ctranslate2/ops/matmul.h>
 #include <ctranslate2/ops/topk.h>
 #include <ctranslate2/translator.h>
 #include <lean/lean.h>
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cctype>
+#include <chrono>
 #include <codecvt>
+#include <condition_variable>
+#include <deque>
 #include <fstream>
+#include <future>
 #include <iostream>
 #include <locale>
+#include <mutex>
+#include <optional>
+#include <sstream>
 #include <stdexcept>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
 #include <vector>
 #include <filesystem>
 
@@ -18,11 +34,307 @@
 
 using json = nlohmann::json;
 
-std::map<std::string, std::unique_ptr<ctranslate2::Translator>> generators;
-std::map<std::string, std::unique_ptr<ctranslate2::Encoder>> encoders;
+// Token <-> id mapping read from the vocabulary files ctranslate2 stores next
+// to `model.bin`. `Translator` only accepts tokens, so id-based generation
+// maps ids through it natively instead of through Lean strings.
+struct Vocabulary {
+  std::vector<std::string> tokens;
+  std::unordered_map<std::string, uint32_t> ids;
+
+  // Both throw `std::invalid_argument` for what is not in the vocabulary,
+  // which the IO externs using them return as errors.
+  const std::string &to_token(uint32_t id) const {
+    if (id >= tokens.size()) {
+      throw std::invalid_argument("Invalid token id " + std::to_string(id) +
+                                  ".");
+    }
+    return tokens[id];
+  }
+
+  uint32_t to_id(const std::string &token) const {
+    auto it = ids.find(token);
+    if (it == ids.end()) {
+      throw std::invalid_argument("Unknown token " + token + ".");
+    }
+    return it->second;
+  }
+};
+
+// How a generation ended, returned to Lean with its outputs.
+enum class GenerationStatus : uint8_t { complete, partial, busy };
+
+// Interrupts a native call once `_cancelled : IO Bool` returns true, e.g.,
+// when Lean cancels the elaboration task waiting for it, or once `deadline_ms`
+// milliseconds have passed if nonzero. ctranslate2's worker threads can't run
+// Lean code, so the calling thread polls `_cancelled` while waiting for them
+// and sets a flag for them to read. Calls without `_cancelled` are never
+// cancelled.
+class Cancellation {
+ public:
+  explicit Cancellation(b_lean_obj_arg _cancelled = nullptr,
+                        uint64_t deadline_ms = 0)
+      : _cancelled(_cancelled),
+        p_stop(std::make_shared<std::atomic<bool>>(false)) {
+    if (deadline_ms > 0) {
+      deadline = std::chrono::steady_clock::now() +
+                 std::chrono::milliseconds(deadline_ms);
+    }
+  }
+
+  // Whether the call was cancelled, in which case its results are dropped.
+  bool poll() {
+    if (!cancelled && _cancelled != nullptr) {
+      lean_inc(_cancelled);
+      lean_object *r = lean_apply_1(_cancelled, lean_io_mk_world());
+      cancelled = lean_io_result_is_ok(r) &&
+                  lean_unbox(lean_io_result_get_value(r));
+      lean_dec(r);
+    }
+    if (deadline && std::chrono::steady_clock::now() >= *deadline) {
+      expired = true;
+    }
+    if (cancelled || expired) {
+      *p_stop = true;
+    }
+    return cancelled;
+  }
+
+  // Whether the deadline passed, in which case results may be unfinished.
+  bool has_expired() const { return expired; }
+
+  // Rejects the call without results, e.g., because too many others wait.
+  void reject() { rejected = true; }
+
+  GenerationStatus status() const {
+    if (rejected) {
+      return GenerationStatus::busy;
+    }
+    return expired ? GenerationStatus::partial : GenerationStatus::complete;
+  }
+
+  // For calls without a status to return them in.
+  void throw_if_rejected() const {
+    if (rejected) {
+      throw std::runtime_error(
+          "The generator is busy: too many generations are waiting for it.");
+    }
+  }
+
+  // ctranslate2 only calls the per-step callback when `beam_size == 1`, so
+  // only greedy decoding and sampling stop at the next step, freeing the
+  // replica and returning the hypotheses decoded so far. Beam search runs to
+  // completion in the background, but the call returns early without results.
+  void stop_decoding_when_interrupted(ctranslate2::TranslationOptions &opts) {
+    if (opts.beam_size == 1) {
+      opts.callback = [p_stop = p_stop](ctranslate2::GenerationStepResult) {
+        return p_stop->load();
+      };
+      interruptible = true;
+    }
+  }
+
+  bool has_deadline() const { return deadline.has_value(); }
+
+  // Waits for `future` unless cancelled first, or unless the deadline passes
+  // first and decoding can't stop early.
+  template <typename Future>
+  auto wait(Future &future)
+      -> std::optional<std::decay_t<decltype(future.get())>> {
+    while (future.wait_for(std::chrono::milliseconds(10)) !=
+           std::future_status::ready) {
+      if (poll() || (expired && !interruptible)) {
+        return std::nullopt;
+      }
+    }
+    return future.get();
+  }
+
+ private:
+  b_lean_obj_arg _cancelled;
+  std::optional<std::chrono::steady_clock::time_point> deadline;
+  std::shared_ptr<std::atomic<bool>> p_stop;
+  bool cancelled = false;
+  bool expired = false;
+  bool rejected = false;
+  bool interruptible = false;
+};
+
+// Priority classes of native requests, from the most to the least urgent,
+// e.g., `suggest_tactics` in the editor, proof search, and warm-up.
+enum class Priority : uint8_t { interactive, search, background };
+
+// Admits at most one generation per replica into ctranslate2, whose own queue
+// is first in, first out, so that waiting requests can be reordered: higher
+// priority classes are admitted first, and when there are several replicas,
+// one is reserved for interactive requests so that they never wait for a
+// proof search saturating the others. At most `max_waiting` requests wait if
+// nonzero, and more are rejected right away instead of piling up. Owned by
+// `std::shared_ptr`, so that slots can outlive the handle.
+class Scheduler : public std::enable_shared_from_this<Scheduler> {
+ public:
+  Scheduler(size_t num_replicas, size_t max_waiting)
+      : num_replicas(num_replicas), max_waiting(max_waiting) {}
+
+  // Queue depths and counters for monitoring overload.
+  struct Stats {
+    size_t num_running;
+    std::array<size_t, 3> num_waiting;
+    size_t num_rejected;
+  };
+
+  // Frees its replica when destroyed.
+  class Slot {
+   public:
+    explicit Slot(std::shared_ptr<Scheduler> p_scheduler)
+        : p_scheduler(std::move(p_scheduler)) {}
+    Slot(Slot &&other) : p_scheduler(std::exchange(other.p_scheduler, {})) {}
+    Slot(const Slot &) = delete;
+    Slot &operator=(Slot &&other) {
+      std::swap(p_scheduler, other.p_scheduler);
+      return *this;
+    }
+    ~Slot() {
+      if (p_scheduler != nullptr) {
+        p_scheduler->release();
+      }
+    }
+
+   private:
+    std::shared_ptr<Scheduler> p_scheduler;
+  };
+
+  // Waits for a replica, or returns none if interrupted first or rejected.
+  std::optional<Slot> acquire(Priority priority, Cancellation &cancellation) {
+    size_t p = static_cast<size_t>(priority);
+    std::unique_lock<std::mutex> lock(mutex);
+    if (!can_run(p) && max_waiting > 0 &&
+        num_waiting[0] + num_waiting[1] + num_waiting[2] >= max_waiting) {
+      num_rejected++;
+      cancellation.reject();
+      return std::nullopt;
+    }
+    num_waiting[p]++;
+    while (!can_run(p)) {
+      if (cv.wait_for(lock, std::chrono::milliseconds(10),
+                      [&] { return can_run(p); })) {
+        break;
+      }
+      lock.unlock();
+      bool cancelled = cancellation.poll();
+      lock.lock();
+      if (cancelled || cancellation.has_expired()) {
+        num_waiting[p]--;
+        cv.notify_all();
+        return std::nullopt;
+      }
+    }
+    num_waiting[p]--;
+    num_running++;
+    return Slot(shared_from_this());
+  }
+
+  Stats stats() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return {num_running, num_waiting, num_rejected};
+  }
+
+ private:
+  // Requires `mutex`.
+  bool can_run(size_t p) const {
+    size_t limit =
+        p == 0 || num_replicas == 1 ? num_replicas : num_replicas - 1;
+    return num_running < limit &&
+           std::all_of(num_waiting.begin(), num_waiting.begin() + p,
+                       [](size_t n) { return n == 0; });
+  }
 
-ctranslate2::StorageView *p_premise_embeddings = nullptr;
-json *p_premise_dictionary = nullptr;
+  void release() {
+    std::lock_guard<std::mutex> lock(mutex);
+    num_running--;
+    cv.notify_all();
+  }
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  const size_t num_replicas;
+  const size_t max_waiting;
+  size_t num_running = 0;
+  std::array<size_t, 3> num_waiting = {};
+  size_t num_rejected = 0;
+};
+
+// Keeps `slot` until `future` is ready. A call returning early, e.g., when
+// cancelled, leaves ctranslate2 decoding in the background, so its replica is
+// only freed for the next generation once that finishes.
+template <typename Future>
+inline void release_when_ready(Scheduler::Slot slot, Future future) {
+  if (!future.valid() || future.wait_for(std::chrono::seconds(0)) ==
+                             std::future_status::ready) {
+    return;
+  }
+  std::thread([slot = std::move(slot), future = std::move(future)] {
+    future.wait();
+  }).detach();
+}
+
+// Submits a batch with `submit`, which returns ctranslate2's futures, once
+// `scheduler` admits it, and waits for it. ctranslate2 runs the batch as one
+// job, so it takes one slot however many examples it has, and its futures
+// are ready at the same time. Returns none if cancelled or rejected first.
+template <typename Submit>
+inline auto run_scheduled(Scheduler &scheduler, Priority priority,
+                          Cancellation &cancellation, Submit submit)
+    -> std::optional<std::vector<std::decay_t<decltype(submit()[0].get())>>> {
+  std::optional<Scheduler::Slot> slot =
+      scheduler.acquire(priority, cancellation);
+  if (!slot) {
+    return std::nullopt;
+  }
+  auto futures = submit();
+  std::vector<std::decay_t<decltype(futures[0].get())>> results;
+  for (auto &future : futures) {
+    auto result = cancellation.wait(future);
+    if (!result) {
+      release_when_ready(std::move(*slot), std::move(futures.back()));
+      return std::nullopt;
+    }
+    results.push_back(std::move(*result));
+  }
+  return results;
+}
+
+// Models are owned by Lean external objects and freed by their finalizers once
+// Lean drops the last reference, so FFI calls get them directly instead of
+// looking them up by name in global maps.
+struct GeneratorHandle {
+  std::unique_ptr<ctranslate2::Translator> model;
+  // Source and target vocabularies, only needed by the id-based API, so a
+  // model without vocabulary files can still be used with tokens.
+  std::optional<std::pair<Vocabulary, Vocabulary>> vocabularies;
+  std::shared_ptr<Scheduler> scheduler;
+};
+
+struct EncoderHandle {
+  std::unique_ptr<ctranslate2::Encoder> model;
+};
+
+template <typename T>
+lean_external_class *handle_class() {
+  static lean_external_class *p_class = lean_register_external_class(
+      [](void *p_handle) { delete static_cast<T *>(p_handle); },
+      [](void *, b_lean_obj_arg) {});
+  return p_class;
+}
+
+template <typename T>
+inline T &to_handle(b_lean_obj_arg _handle) {
+  return *static_cast<T *>(lean_get_external_data(_handle));
+}
+
+// Accessed with `std::atomic_load`/`std::atomic_store`, so that unloading
+// them does not free the data under a concurrent retrieval.
+std::shared_ptr<ctranslate2::StorageView> p_premise_embeddings;
+std::shared_ptr<json> p_premise_dictionary;
 
 // ifstream does not support directories on Windows
 inline bool exists(const std::string &path) {
@@ -36,84 +348,146 @@ inline lean_obj_res lean_mk_pair(lean_obj_arg a, lean_obj_arg b) {
   return r;
 }
 
-extern "C" uint8_t cuda_available(b_lean_obj_arg) {
-  return ctranslate2::str_to_device("auto") == ctranslate2::Device::CUDA;
+inline lean_obj_res mk_lean_string(const std::string &s) {
+  return lean_mk_string_from_bytes(s.data(), s.size());
 }
 
-template <typename T>
-bool is_initialized_aux(const std::string &name);
-
-template <>
-bool is_initialized_aux<ctranslate2::Translator>(const std::string &name) {
-  return generators.find(name) != generators.end();
-}
-
-template <>
-bool is_initialized_aux<ctranslate2::Encoder>(const std::string &name) {
-  return encoders.find(name) != encoders.end();
-}
-
-extern "C" uint8_t is_generator_initialized(b_lean_obj_arg _name) {
-  std::string name = std::string(lean_string_cstr(_name));
-  return is_initialized_aux<ctranslate2::Translator>(name);
+extern "C" uint8_t cuda_available(b_lean_obj_arg) {
+  return ctranslate2::str_to_device("auto") == ctranslate2::Device::CUDA;
 }
 
-extern "C" uint8_t is_encoder_initialized(b_lean_obj_arg _name) {
-  std::string name = std::string(lean_string_cstr(_name));
-  return is_initialized_aux<ctranslate2::Encoder>(name);
+// Turns the result of `f` into an `IO` result, and C++ exceptions, e.g.,
+// from ctranslate2 failing to load a model, into `IO.userError`s.
+template <typename F>
+inline lean_obj_res mk_lean_io_result(F f) {
+  try {
+    return lean_io_result_mk_ok(f());
+  } catch (const std::exception &e) {
+    return lean_io_result_mk_error(
+        lean_mk_io_user_error(mk_lean_string(e.what())));
+  }
 }
 
 template <typename T>
-bool init_model(b_lean_obj_arg _name,          // String
-                b_lean_obj_arg _model_path,    // String
-                b_lean_obj_arg _compute_type,  // String
-                b_lean_obj_arg _device,        // String
-                b_lean_obj_arg _device_index,  // Array UInt64
-                std::map<std::string, std::unique_ptr<T>> &models) {
-  std::string name = std::string(lean_string_cstr(_name));
-  if (is_initialized_aux<T>(name)) {
-    throw std::runtime_error(name + " already exists.");
-  }
-
+std::unique_ptr<T> init_model(b_lean_obj_arg _model_path,    // String
+                              b_lean_obj_arg _compute_type,  // String
+                              b_lean_obj_arg _device,        // String
+                              b_lean_obj_arg _device_index,  // Array UInt64
+                              uint64_t inter_threads,        // UInt64
+                              uint64_t intra_threads,        // UInt64
+                              int64_t max_queued_batches,    // Int64
+                              int64_t cpu_core_offset) {     // Int64
   std::string model_path = std::string(lean_string_cstr(_model_path));
-  if (!exists(model_path)) {  // Cannot find the model.
-    return false;
+  if (!exists(model_path)) {
+    throw std::runtime_error("Cannot find the model at " + model_path + ".");
+  }
+  if (inter_threads <= 0) {
+    throw std::invalid_argument("inter_threads must be positive.");
   }
 
-  ctranslate2::Device device =
-      ctranslate2::str_to_device(lean_string_cstr(_device));
-  ctranslate2::ComputeType compute_type =
+  ctranslate2::models::ModelLoader model_loader(model_path);
+  model_loader.device = ctranslate2::str_to_device(lean_string_cstr(_device));
+  model_loader.compute_type =
       ctranslate2::str_to_compute_type(lean_string_cstr(_compute_type));
+  // On CPU, ctranslate2 runs `inter_threads` replicas of the model in
+  // parallel, each using `intra_threads` threads.
+  model_loader.num_replicas_per_device = inter_threads;
 
   std::vector<int> device_indices;
   const lean_array_object *p_arr = lean_to_array(_device_index);
   for (int i = 0; i < p_arr->m_size; i++) {
     device_indices.push_back(lean_unbox_uint64(p_arr->m_data[i]));
   }
+  model_loader.device_indices = device_indices;
+
+  ctranslate2::ReplicaPoolConfig pool_config;
+  pool_config.num_threads_per_replica = intra_threads;
+  pool_config.max_queued_batches = max_queued_batches;
+  pool_config.cpu_core_offset = cpu_core_offset;
 
-  auto p_model =
-      std::make_unique<T>(model_path, device, compute_type, device_indices);
-  models.emplace(name, std::move(p_model));
+  return std::make_unique<T>(model_loader, pool_config);
+}
+
+// Read `<model_path>/<basename>.json` or `<model_path>/<basename>.txt`.
+inline bool read_vocabulary(const std::filesystem::path &model_path,
+                     const std::string &basename, Vocabulary &vocab) {
+  std::filesystem::path json_path = model_path / (basename + ".json");
+  std::filesystem::path txt_path = model_path / (basename + ".txt");
+  if (exists(json_path.string())) {
+    std::ifstream f(json_path);
+    vocab.tokens = json::parse(f).get<std::vector<std::string>>();
+  } else if (exists(txt_path.string())) {
+    std::ifstream f(txt_path);
+    std::string token;
+    while (std::getline(f, token)) {
+      vocab.tokens.push_back(token);
+    }
+  } else {
+    return false;
+  }
+  for (uint32_t i = 0; i < vocab.tokens.size(); i++) {
+    vocab.ids.emplace(vocab.tokens[i], i);
+  }
   return true;
 }
 
-extern "C" uint8_t init_generator(
-    b_lean_obj_arg _name,            // String
+extern "C" lean_obj_res init_generator(
     b_lean_obj_arg _model_path,      // String
     b_lean_obj_arg _compute_type,    // String
     b_lean_obj_arg _device,          // String
-    b_lean_obj_arg _device_index) {  // Array UInt64
-  return init_model(_name, _model_path, _compute_type, _device, _device_index,
-                    generators);
+    b_lean_obj_arg _device_index,    // Array UInt64
+    uint64_t inter_threads,          // UInt64
+    uint64_t intra_threads,          // UInt64
+    int64_t max_queued_batches,      // Int64
+    int64_t cpu_core_offset,         // Int64
+    uint64_t max_waiting,            // UInt64
+    lean_obj_arg /* w */) {
+  return mk_lean_io_result([&] {
+    auto p_handle = std::make_unique<GeneratorHandle>();
+    p_handle->model = init_model<ctranslate2::Translator>(
+        _model_path, _compute_type, _device, _device_index, inter_threads,
+        intra_threads, max_queued_batches, cpu_core_offset);
+    p_handle->scheduler = std::make_shared<Scheduler>(
+        p_handle->model->num_replicas(), max_waiting);
+
+    std::filesystem::path model_path = lean_string_cstr(_model_path);
+    Vocabulary source_vocab, target_vocab;
+    bool has_vocabularies;
+    if (read_vocabulary(model_path, "shared_vocabulary", source_vocab)) {
+      target_vocab = source_vocab;
+      has_vocabularies = true;
+    } else {
+      has_vocabularies =
+          read_vocabulary(model_path, "source_vocabulary", source_vocab) &&
+          read_vocabulary(model_path, "target_vocabulary", target_vocab);
+    }
+    if (has_vocabularies) {
+      p_handle->vocabularies.emplace(std::move(source_vocab),
+                                     std::move(target_vocab));
+    }
+    return lean_alloc_external(handle_class<GeneratorHandle>(),
+                               p_handle.release());
+  });
 }
 
-extern "C" uint8_t init_encoder(b_lean_obj_arg _name,            // String
-                                b_lean_obj_arg _model_path,      // String
-                                b_lean_obj_arg _compute_type,    // String
-                                b_lean_obj_arg _device,          // String
-                                b_lean_obj_arg _device_index) {  // Array UInt64
-  return init_model(_name, _model_path, _compute_type, _device, _device_index,
-                    encoders);
+extern "C" lean_obj_res init_encoder(
+    b_lean_obj_arg _model_path,      // String
+    b_lean_obj_arg _compute_type,    // String
+    b_lean_obj_arg _device,          // String
+    b_lean_obj_arg _device_index,    // Array UInt64
+    uint64_t inter_threads,          // UInt64
+    uint64_t intra_threads,          // UInt64
+    int64_t max_queued_batches,      // Int64
+    int64_t cpu_core_offset,         // Int64
+    lean_obj_arg /* w */) {
+  return mk_lean_io_result([&] {
+    auto p_handle = std::make_unique<EncoderHandle>();
+    p_handle->model = init_model<ctranslate2::Encoder>(
+        _model_path, _compute_type, _device, _device_index, inter_threads,
+        intra_threads, max_queued_batches, cpu_core_offset);
+    return lean_alloc_external(handle_class<EncoderHandle>(),
+                               p_handle.release());
+  });
 }
 
 inline std::vector<std::string> convert_tokens(b_lean_obj_arg _tokens) {
@@ -125,22 +499,52 @@ inline std::vector<std::string> convert_tokens(b_lean_obj_arg _tokens) {
   return tokens;
 }
 
-extern "C" lean_obj_res generate(
-    b_lean_obj_arg _name,                  // String
-    b_lean_obj_arg _input_tokens,          // Array String
-    b_lean_obj_arg _target_prefix_tokens,  // Array String
-    uint64_t num_return_sequences,         // UInt64
-    uint64_t beam_size,                    // UInt64
-    uint64_t min_length,                   // UInt64
-    uint64_t max_length,                   // UInt64
-    double length_penalty,                 // Float
-    double patience,                       // Float
-    double temperature) {                  // Float
-  // Check the arguments.
-  std::string name = std::string(lean_string_cstr(_name));
-  if (!is_initialized_aux<ctranslate2::Translator>(name)) {
-    throw std::runtime_error(name + " hasn't been initialized.");
+inline std::vector<std::vector<std::string>> convert_token_lists(
+    b_lean_obj_arg _token_lists) {
+  std::vector<std::vector<std::string>> token_lists;
+  const lean_array_object *p_arr = lean_to_array(_token_lists);
+  for (int i = 0; i < p_arr->m_size; i++) {
+    token_lists.push_back(convert_tokens(p_arr->m_data[i]));
+  }
+  return token_lists;
+}
+
+inline std::vector<size_t> convert_ids(b_lean_obj_arg _ids) {
+  std::vector<size_t> ids;
+  const lean_array_object *p_arr = lean_to_array(_ids);
+  ids.reserve(p_arr->m_size);
+  for (int i = 0; i < p_arr->m_size; i++) {
+    ids.push_back(lean_unbox_uint32(p_arr->m_data[i]));
+  }
+  return ids;
+}
+
+inline std::vector<std::string> ids_to_tokens(b_lean_obj_arg _ids,
+                                              const Vocabulary &vocab) {
+  std::vector<std::string> tokens;
+  const lean_array_object *p_arr = lean_to_array(_ids);
+  tokens.reserve(p_arr->m_size);
+  for (int i = 0; i < p_arr->m_size; i++) {
+    tokens.push_back(vocab.to_token(lean_unbox_uint32(p_arr->m_data[i])));
   }
+  return tokens;
+}
+
+inline std::vector<std::vector<std::string>> id_lists_to_tokens(
+    b_lean_obj_arg _id_lists, const Vocabulary &vocab) {
+  std::vector<std::vector<std::string>> token_lists;
+  const lean_array_object *p_arr = lean_to_array(_id_lists);
+  for (int i = 0; i < p_arr->m_size; i++) {
+    token_lists.push_back(ids_to_tokens(p_arr->m_data[i], vocab));
+  }
+  return token_lists;
+}
+
+inline ctranslate2::TranslationOptions make_translation_options(
+    uint64_t num_return_sequences, uint64_t beam_size, uint64_t min_length,
+    uint64_t max_length, double length_penalty, double patience,
+    double temperature, uint64_t sampling_topk) {
+  // Check the arguments.
   if (num_return_sequences <= 0) {
     throw std::invalid_argument("num_return_sequences must be positive.");
   }
@@ -166,56 +570,1243 @@ extern "C" lean_obj_res generate(
   opts.min_decoding_length = min_length;
   opts.max_decoding_length = max_length;
   opts.sampling_temperature = temperature;
-  opts.sampling_topk = 0;
+  opts.sampling_topk = sampling_topk;
   opts.sampling_topp = 1.0;
   opts.max_input_length = 0;
   opts.use_vmap = true;
   opts.disable_unk = true;
   opts.return_scores = true;
+  return opts;
+}
+
+// Stop decoding at any of `end_tokens` besides `eos_token`, e.g., at the end
+// of the first line for single-line tactics.
+inline void set_end_tokens(ctranslate2::TranslationOptions &opts,
+                           std::vector<std::string> end_tokens,
+                           const std::string &eos_token) {
+  // Always listed explicitly, with EOS last, for `GenerationStream`.
+  end_tokens.push_back(eos_token);
+  opts.end_token = std::move(end_tokens);
+}
 
-  // Get the input tokens ready.
-  std::vector<std::string> input_tokens = convert_tokens(_input_tokens);
-  std::vector<std::string> target_prefix_tokens =
-      convert_tokens(_target_prefix_tokens);
+// Mask `sequences` anywhere in the outputs, and `endings` right before
+// decoding stops, so that no beam is spent on outputs discarded afterwards.
+inline void set_suppressed_sequences(
+    ctranslate2::TranslationOptions &opts,
+    std::vector<std::vector<std::string>> sequences,
+    const std::vector<std::vector<std::string>> &endings,
+    std::vector<std::string> end_tokens, const std::string &eos_token) {
+  end_tokens.push_back(eos_token);
+  for (const std::vector<std::string> &ending : endings) {
+    for (const std::string &end_token : end_tokens) {
+      sequences.push_back(ending);
+      sequences.back().push_back(end_token);
+    }
+  }
+  opts.suppress_sequences = std::move(sequences);
+}
 
-  // Generate tactics with beam search.
-  ctranslate2::TranslationResult results = generators.at(name)->translate_batch(
-      {input_tokens}, {target_prefix_tokens}, opts)[0];
-  assert(results.hypotheses.size() == num_return_sequences &&
-         results.scores.size() == num_return_sequences);
+// Pairs `output` with how the generation ended.
+inline lean_obj_res mk_lean_generation(lean_obj_arg output,
+                                       const Cancellation &cancellation) {
+  return lean_mk_pair(output,
+                      lean_box(static_cast<uint8_t>(cancellation.status())));
+}
 
-  // Return the output.
-  lean_object *output = lean_mk_empty_array();
+// Identical concurrent calls, e.g., from parallel elaboration of duplicated
+// goals, share one decoding instead of each running a beam search. Entries
+// only live while decoding, so this is not a cache.
+struct InFlightGeneration {
+  std::shared_future<ctranslate2::TranslationResult> future;
+  // Callers still waiting. Greedy decoding stops once all are cancelled.
+  std::shared_ptr<std::atomic<size_t>> p_num_waiting;
+};
+
+std::mutex in_flight_mutex;
+std::unordered_map<std::string, InFlightGeneration> in_flight_generations;
+
+// Everything determining the result of a generation, hashed by
+// `in_flight_generations`.
+inline std::string generation_key(
+    const GeneratorHandle &generator,
+    const std::vector<std::string> &input_tokens,
+    const std::vector<std::string> &target_prefix_tokens,
+    const ctranslate2::TranslationOptions &opts) {
+  std::ostringstream key;
+  auto add_tokens = [&](const std::vector<std::string> &tokens) {
+    key << tokens.size() << '\0';
+    for (const std::string &token : tokens) {
+      key << token << '\0';
+    }
+  };
+  key << &generator << '\0' << opts.num_hypotheses << ' ' << opts.beam_size
+      << ' ' << opts.patience << ' ' << opts.length_penalty << ' '
+      << opts.min_decoding_length << ' ' << opts.max_decoding_length << ' '
+      << opts.sampling_temperature << ' ' << opts.sampling_topk << ' '
+      << opts.disable_unk << ' ' << opts.return_end_token << ' '
+      << opts.return_alternatives << '\0';
+  add_tokens(input_tokens);
+  add_tokens(target_prefix_tokens);
+  if (auto p_end_tokens =
+          std::get_if<std::vector<std::string>>(&opts.end_token)) {
+    add_tokens(*p_end_tokens);
+  }
+  key << opts.suppress_sequences.size() << '\0';
+  for (const std::vector<std::string> &sequence : opts.suppress_sequences) {
+    add_tokens(sequence);
+  }
+  return key.str();
+}
+
+// Joins an identical generation in flight, or starts one.
+inline std::optional<ctranslate2::TranslationResult> coalesced_generate_aux(
+    GeneratorHandle &generator, const std::vector<std::string> &input_tokens,
+    const std::vector<std::string> &target_prefix_tokens,
+    ctranslate2::TranslationOptions opts, Cancellation &cancellation,
+    Priority priority) {
+  std::string key =
+      generation_key(generator, input_tokens, target_prefix_tokens, opts);
+  InFlightGeneration generation;
+  // Joins the generation in flight for `key` if any. Requires
+  // `in_flight_mutex`.
+  auto join = [&] {
+    auto it = in_flight_generations.find(key);
+    if (it == in_flight_generations.end()) {
+      return false;
+    }
+    generation = it->second;
+    ++*generation.p_num_waiting;
+    return true;
+  };
+  std::optional<Scheduler::Slot> slot;
+  {
+    std::unique_lock<std::mutex> lock(in_flight_mutex);
+    if (!join()) {
+      // Wait for a replica without blocking other calls, then check again.
+      lock.unlock();
+      slot = generator.scheduler->acquire(priority, cancellation);
+      if (!slot) {
+        return std::nullopt;
+      }
+      lock.lock();
+    }
+    if (slot && join()) {
+      slot.reset();
+    } else if (slot) {
+      generation.p_num_waiting = std::make_shared<std::atomic<size_t>>(1);
+      if (opts.beam_size == 1) {
+        opts.callback = [p_num_waiting = generation.p_num_waiting](
+                            ctranslate2::GenerationStepResult) {
+          return *p_num_waiting == 0;
+        };
+      }
+      generation.future =
+          std::move(generator.model->translate_batch_async(
+                        {input_tokens}, {target_prefix_tokens}, opts)[0])
+              .share();
+      in_flight_generations.emplace(key, generation);
+    }
+  }
+
+  // Leaves the generation, removing it once finished or abandoned.
+  auto leave = [&](bool is_finished) {
+    std::lock_guard<std::mutex> lock(in_flight_mutex);
+    bool is_last = --*generation.p_num_waiting == 0;
+    auto it = in_flight_generations.find(key);
+    if (it != in_flight_generations.end() &&
+        it->second.p_num_waiting == generation.p_num_waiting &&
+        (is_finished || is_last)) {
+      in_flight_generations.erase(it);
+    }
+  };
+  std::optional<ctranslate2::TranslationResult> results;
+  try {
+    results = cancellation.wait(generation.future);
+  } catch (...) {
+    leave(true);
+    throw;
+  }
+  leave(results.has_value());
+  // The leader's replica stays busy while others, if any, wait for it.
+  if (slot) {
+    release_when_ready(std::move(*slot), generation.future);
+  }
+  return results;
+}
+
+inline ctranslate2::TranslationResult generate_aux(
+    GeneratorHandle &generator, const std::vector<std::string> &input_tokens,
+    const std::vector<std::string> &target_prefix_tokens,
+    ctranslate2::TranslationOptions opts, Cancellation &cancellation,
+    Priority priority = Priority::interactive) {
+  // Generate tactics with beam search, returning no hypotheses if cancelled
+  // and the unfinished ones, if any, once the deadline passes. Results cut
+  // short by a deadline are specific to the caller, and sampled ones should
+  // differ between callers, so only deterministic calls, i.e., those with
+  // `sampling_topk == 1`, are coalesced. ctranslate2 samples within beam
+  // search too otherwise.
+  std::optional<ctranslate2::TranslationResult> results;
+  if (!cancellation.has_deadline() && opts.sampling_topk == 1) {
+    results = coalesced_generate_aux(generator, input_tokens,
+                                     target_prefix_tokens, opts, cancellation,
+                                     priority);
+  } else if (std::optional<Scheduler::Slot> slot =
+                 generator.scheduler->acquire(priority, cancellation)) {
+    cancellation.stop_decoding_when_interrupted(opts);
+    std::future<ctranslate2::TranslationResult> future =
+        std::move(generator.model->translate_batch_async(
+            {input_tokens}, {target_prefix_tokens}, opts)[0]);
+    results = cancellation.wait(future);
+    release_when_ready(std::move(*slot), std::move(future));
+  }
+  if (!results || cancellation.poll()) {
+    return {};
+  }
+  assert(cancellation.has_expired() ||
+         (results->hypotheses.size() == opts.num_hypotheses &&
+          results->scores.size() == opts.num_hypotheses));
+  return std::move(*results);
+}
+
+inline double hypothesis_score(const ctranslate2::TranslationResult &results,
+                               int i) {
+  double score = std::exp(results.scores[i]);
+  assert(0.0 <= score && score <= 1.0);
+  return score;
+}
+
+extern "C" lean_obj_res generate(
+    b_lean_obj_arg _generator,             // GeneratorHandle
+    b_lean_obj_arg _input_tokens,          // Array String
+    b_lean_obj_arg _target_prefix_tokens,  // Array String
+    uint64_t num_return_sequences,         // UInt64
+    uint64_t beam_size,                    // UInt64
+    uint64_t min_length,                   // UInt64
+    uint64_t max_length,                   // UInt64
+    double length_penalty,                 // Float
+    double patience,                       // Float
+    double temperature,                    // Float
+    uint64_t sampling_topk,                // UInt64
+    b_lean_obj_arg _end_tokens,            // Array String
+    b_lean_obj_arg _eos_token,             // String
+    b_lean_obj_arg _suppressed_sequences,  // Array (Array String)
+    b_lean_obj_arg _suppressed_endings,    // Array (Array String)
+    uint64_t deadline_ms,                  // UInt64
+    uint8_t priority,                      // UInt8
+    b_lean_obj_arg _cancelled,             // IO Bool
+    lean_obj_arg /* w */) {
+  return mk_lean_io_result([&] {
+    GeneratorHandle &generator = to_handle<GeneratorHandle>(_generator);
+    Cancellation cancellation(_cancelled, deadline_ms);
+    ctranslate2::TranslationOptions opts =
+        make_translation_options(num_return_sequences, beam_size, min_length,
+                                 max_length, length_penalty, patience,
+                                 temperature, sampling_topk);
+    std::vector<std::string> end_tokens = convert_tokens(_end_tokens);
+    std::string eos_token = lean_string_cstr(_eos_token);
+    set_end_tokens(opts, end_tokens, eos_token);
+    set_suppressed_sequences(opts, convert_token_lists(_suppressed_sequences),
+                             convert_token_lists(_suppressed_endings),
+                             end_tokens, eos_token);
+
+    // Get the input tokens ready.
+    std::vector<std::string> input_tokens = convert_tokens(_input_tokens);
+    std::vector<std::string> target_prefix_tokens =
+        convert_tokens(_target_prefix_tokens);
+
+    ctranslate2::TranslationResult results =
+        generate_aux(generator, input_tokens, target_prefix_tokens, opts,
+                     cancellation, static_cast<Priority>(priority));
+
+    // Return the output, which is empty if cancelled.
+    lean_object *output = lean_mk_empty_array();
+
+    for (size_t i = 0; i < results.hypotheses.size(); i++) {
+      int l = results.hypotheses[i].size();
+
+      lean_object *tokens = lean_mk_empty_array();
+      for (int j = 0; j < l; j++) {
+        tokens = lean_array_push(
+            tokens, lean_mk_string(results.hypotheses[i][j].c_str()));
+      }
+      double score = hypothesis_score(results, i);
+      output =
+          lean_array_push(output, lean_mk_pair(tokens, lean_box_float(score)));
+    }
+
+    return mk_lean_generation(output, cancellation);
+  });
+}
+
+// ByT5 maps every UTF-8 byte `b` to the vocabulary token spelling the code
+// point `b`, e.g., 0x41 -> "A" and 0xE2 -> "â". Tokenizing and
+// detokenizing natively lets ByT5 models pass whole strings through FFI
+// instead of one Lean `String` per byte.
+const std::string byt5_eos_token = "</s>";
+
+inline const std::string &byt5_byte_to_token(uint8_t b) {
+  static const std::vector<std::string> table = [] {
+    std::vector<std::string> t(256);
+    for (int c = 0; c < 256; c++) {
+      if (c < 0x80) {
+        t[c] = std::string(1, static_cast<char>(c));
+      } else {
+        t[c] = {static_cast<char>(0xC0 | (c >> 6)),
+                static_cast<char>(0x80 | (c & 0x3F))};
+      }
+    }
+    return t;
+  }();
+  return table[b];
+}
+
+// Returns -1 for tokens not representing a byte, e.g., "</s>".
+inline int byt5_token_to_byte(const std::string &token) {
+  const auto *p = reinterpret_cast<const unsigned char *>(token.data());
+  if (token.size() == 1 && p[0] < 0x80) {
+    return p[0];
+  }
+  if (token.size() == 2 && (p[0] == 0xC2 || p[0] == 0xC3) &&
+      (p[1] & 0xC0) == 0x80) {
+    return ((p[0] & 0x1F) << 6) | (p[1] & 0x3F);
+  }
+  return -1;
+}
+
+inline std::vector<std::string> byt5_tokenize(const char *text, size_t size) {
+  std::vector<std::string> tokens;
+  tokens.reserve(size + 1);
+  for (size_t i = 0; i < size; i++) {
+    tokens.push_back(byt5_byte_to_token(static_cast<uint8_t>(text[i])));
+  }
+  return tokens;
+}
+
+inline std::vector<std::string> byt5_tokenize(b_lean_obj_arg _text) {
+  // `lean_string_size` counts the trailing '\0'.
+  return byt5_tokenize(lean_string_cstr(_text), lean_string_size(_text) - 1);
+}
+
+inline std::vector<std::vector<std::string>> byt5_tokenize_each(
+    b_lean_obj_arg _texts) {
+  std::vector<std::vector<std::string>> token_lists;
+  const lean_array_object *p_arr = lean_to_array(_texts);
+  for (int i = 0; i < p_arr->m_size; i++) {
+    token_lists.push_back(byt5_tokenize(p_arr->m_data[i]));
+  }
+  return token_lists;
+}
+
+// Matches Lean's `String.validateUTF8`, rejecting overlong encodings,
+// surrogates and code points beyond U+10FFFF.
+inline bool is_valid_utf8(const std::string &s) {
+  const auto *p = reinterpret_cast<const unsigned char *>(s.data());
+  size_t n = s.size();
+  for (size_t i = 0; i < n;) {
+    size_t len = p[i] < 0x80           ? 1
+                 : (p[i] & 0xE0) == 0xC0 ? 2
+                 : (p[i] & 0xF0) == 0xE0 ? 3
+                 : (p[i] & 0xF8) == 0xF0 ? 4
+                                         : 0;
+    if (len == 0 || i + len > n) {
+      return false;
+    }
+    uint32_t c = len == 1 ? p[i] : p[i] & (0x7F >> len);
+    for (size_t j = 1; j < len; j++) {
+      if ((p[i + j] & 0xC0) != 0x80) {
+        return false;
+      }
+      c = (c << 6) | (p[i + j] & 0x3F);
+    }
+    constexpr uint32_t min_code_point[] = {0, 0, 0x80, 0x800, 0x10000};
+    if (c < min_code_point[len] || (0xD800 <= c && c <= 0xDFFF) ||
+        c > 0x10FFFF) {
+      return false;
+    }
+    i += len;
+  }
+  return true;
+}
+
+// Like `ByT5.detokenize`, returns an empty string for invalid UTF-8.
+inline std::string byt5_detokenize(const std::vector<std::string> &tokens) {
+  std::string text;
+  text.reserve(tokens.size());
+  for (const std::string &token : tokens) {
+    int b = byt5_token_to_byte(token);
+    if (b >= 0) {
+      text.push_back(static_cast<char>(b));
+    }
+  }
+  return is_valid_utf8(text) ? text : std::string();
+}
 
-  for (int i = 0; i < num_return_sequences; i++) {
-    int l = results.hypotheses[i].size();
+// A compact byte-level automaton accepting a syntactic superset of tactics:
+// brackets are balanced and properly nested outside of string and character
+// literals and comments, and the first word is one of `keywords` unless it is
+// empty.
+const std::vector<std::pair<std::string, std::string>> tactic_brackets = {
+    {"(", ")"}, {"[", "]"}, {"{", "}"}, {"⟨", "⟩"}, {"⦃", "⦄"},
+    {"‹", "›"}, {"«", "»"}, {"⌊", "⌋"}, {"⌈", "⌉"}};
 
-    lean_object *tokens = lean_mk_empty_array();
-    for (int j = 0; j < l; j++) {
-      tokens = lean_array_push(
-          tokens, lean_mk_string(results.hypotheses[i][j].c_str()));
+struct TacticSyntax {
+  std::vector<std::string> keywords;
+
+  // The size of the character literal at `i`, e.g., `'('` or `'\n'`, or 0 if
+  // there is none, e.g., for the prime in `h'`.
+  static size_t char_literal_size(const std::string &tactic, size_t i) {
+    if (i > 0) {
+      unsigned char prev = tactic[i - 1];
+      if (std::isalnum(prev) || prev == '_' || prev == '\'' ||
+          prev == '!' || prev == '?') {
+        return 0;
+      }
+    }
+    size_t end;
+    if (i + 1 < tactic.size() && tactic[i + 1] == '\\') {
+      // Escapes are at most `\u{10ffff}` long.
+      end = tactic.find('\'', i + 3);
+      if (end == std::string::npos || end - i > 11) {
+        return 0;
+      }
+    } else {
+      unsigned char lead = i + 1 < tactic.size() ? tactic[i + 1] : 0;
+      size_t length = lead < 0x80 ? 1 : lead < 0xe0 ? 2 : lead < 0xf0 ? 3 : 4;
+      end = i + 1 + length;
+      if (lead == 0 || lead == '\'' || end >= tactic.size() ||
+          tactic[end] != '\'') {
+        return 0;
+      }
+    }
+    return end + 1 - i;
+  }
+
+  bool accepts(const std::string &tactic) const {
+    size_t start = tactic.find_first_not_of(" \t\n");
+    if (start == std::string::npos) {
+      return false;
+    }
+    if (!keywords.empty()) {
+      size_t end = tactic.find_first_of(" \t\n([{", start);
+      std::string word = tactic.substr(start, end - start);
+      if (std::find(keywords.begin(), keywords.end(), word) ==
+          keywords.end()) {
+        return false;
+      }
     }
-    double score = std::exp(results.scores[i]);
-    assert(0.0 <= score && score <= 1.0);
-    output =
-        lean_array_push(output, lean_mk_pair(tokens, lean_box_float(score)));
+
+    std::vector<const std::string *> closers;
+    for (size_t i = start; i < tactic.size();) {
+      if (tactic[i] == '"') {
+        for (i++; i < tactic.size() && tactic[i] != '"'; i++) {
+          if (tactic[i] == '\\') {
+            i++;
+          }
+        }
+        if (i >= tactic.size()) {
+          return false;  // Unterminated string literal.
+        }
+        i++;
+        continue;
+      }
+      if (tactic[i] == '\'') {
+        size_t size = char_literal_size(tactic, i);
+        i += size > 0 ? size : 1;
+        continue;
+      }
+      if (tactic.compare(i, 2, "--") == 0) {
+        i = tactic.find('\n', i);
+        if (i == std::string::npos) {
+          break;
+        }
+        continue;
+      }
+      if (tactic.compare(i, 2, "/-") == 0) {
+        // Block comments nest.
+        size_t depth = 1;
+        for (i += 2; i < tactic.size() && depth > 0;) {
+          if (tactic.compare(i, 2, "/-") == 0) {
+            depth++;
+            i += 2;
+          } else if (tactic.compare(i, 2, "-/") == 0) {
+            depth--;
+            i += 2;
+          } else {
+            i++;
+          }
+        }
+        if (depth > 0) {
+          return false;  // Unterminated block comment.
+        }
+        continue;
+      }
+      bool is_bracket = false;
+      for (const auto &[open, close] : tactic_brackets) {
+        if (tactic.compare(i, open.size(), open) == 0) {
+          closers.push_back(&close);
+          i += open.size();
+          is_bracket = true;
+          break;
+        }
+        if (tactic.compare(i, close.size(), close) == 0) {
+          if (closers.empty() || *closers.back() != close) {
+            return false;
+          }
+          closers.pop_back();
+          i += close.size();
+          is_bracket = true;
+          break;
+        }
+      }
+      if (!is_bracket) {
+        i++;
+      }
+    }
+    return closers.empty();
   }
+};
 
+inline lean_obj_res mk_lean_outputs(
+    const std::vector<std::pair<std::string, double>> &outputs) {
+  lean_object *output = lean_mk_empty_array();
+  for (const auto &[text, score] : outputs) {
+    output = lean_array_push(
+        output, lean_mk_pair(mk_lean_string(text), lean_box_float(score)));
+  }
   return output;
 }
 
-extern "C" lean_obj_res encode(b_lean_obj_arg _name,            // String
-                               b_lean_obj_arg _input_tokens) {  // Array String
-  std::string name = std::string(lean_string_cstr(_name));
-  if (!is_initialized_aux<ctranslate2::Encoder>(name)) {
-    throw std::runtime_error(name + " hasn't been initialized.");
+inline std::vector<std::string> byt5_end_tokens(b_lean_obj_arg _end_tokens) {
+  std::vector<std::string> end_tokens;
+  for (const std::string &end_token : convert_tokens(_end_tokens)) {
+    if (end_token.size() != 1) {
+      throw std::invalid_argument("ByT5 end tokens must be single bytes.");
+    }
+    end_tokens.push_back(byt5_byte_to_token(end_token[0]));
+  }
+  return end_tokens;
+}
+
+inline void set_byt5_stop_conditions(ctranslate2::TranslationOptions &opts,
+                                     b_lean_obj_arg _end_tokens,
+                                     b_lean_obj_arg _suppressed_sequences,
+                                     b_lean_obj_arg _suppressed_endings) {
+  std::vector<std::string> end_tokens = byt5_end_tokens(_end_tokens);
+  set_end_tokens(opts, end_tokens, byt5_eos_token);
+  set_suppressed_sequences(opts, byt5_tokenize_each(_suppressed_sequences),
+                           byt5_tokenize_each(_suppressed_endings), end_tokens,
+                           byt5_eos_token);
+}
+
+// Trims whitespace and collapses runs of spaces and tabs into one space
+// outside of string literals and indentation, which doesn't change what a
+// tactic means.
+inline std::string normalize_tactic(const std::string &tactic) {
+  std::string normalized;
+  normalized.reserve(tactic.size());
+  bool in_string = false;
+  bool indenting = false;
+  bool pending_space = false;
+  for (size_t i = 0; i < tactic.size(); i++) {
+    char c = tactic[i];
+    if (!in_string && (c == ' ' || c == '\t')) {
+      if (indenting) {
+        normalized.push_back(c);
+      } else {
+        pending_space = !normalized.empty();
+      }
+      continue;
+    }
+    if (!in_string && c == '\n') {
+      pending_space = false;
+      indenting = true;
+    } else {
+      indenting = false;
+    }
+    if (pending_space) {
+      normalized.push_back(' ');
+      pending_space = false;
+    }
+    normalized.push_back(c);
+    if (c == '"') {
+      in_string = !in_string;
+    } else if (in_string && c == '\\' && i + 1 < tactic.size()) {
+      normalized.push_back(tactic[++i]);
+    }
+  }
+  size_t end = normalized.find_last_not_of(" \t\n");
+  normalized.erase(end == std::string::npos ? 0 : end + 1);
+  return normalized;
+}
+
+// Post-processing of finished ByT5 beams before any Lean object is built.
+// ctranslate2 doesn't expose per-step logits to mask for beam search, so the
+// syntax constraint is checked on the hypotheses the search returns anyway,
+// without decoding more of them. Outputs that fail it, or duplicates merged by
+// adding up their probabilities, are dropped, so fewer than
+// `num_return_sequences` outputs may be returned.
+struct Byt5OutputFilter {
+  bool constrain_syntax;
+  TacticSyntax syntax;
+  bool deduplicate;
+};
+
+inline std::vector<std::pair<std::string, double>> byt5_outputs(
+    const ctranslate2::TranslationResult &results,
+    uint64_t num_return_sequences, const Byt5OutputFilter &filter) {
+  std::vector<std::pair<std::string, double>> outputs;
+  std::unordered_map<std::string, size_t> indices;
+  for (size_t i = 0; i < results.hypotheses.size(); i++) {
+    if (!filter.deduplicate && outputs.size() == num_return_sequences) {
+      break;
+    }
+    std::string text = byt5_detokenize(results.hypotheses[i]);
+    if (filter.deduplicate) {
+      text = normalize_tactic(text);
+    }
+    if (filter.constrain_syntax && !filter.syntax.accepts(text)) {
+      continue;
+    }
+    double score = hypothesis_score(results, i);
+    if (filter.deduplicate) {
+      auto [it, inserted] = indices.emplace(text, outputs.size());
+      if (!inserted) {
+        outputs[it->second].second += score;
+        continue;
+      }
+    }
+    outputs.emplace_back(std::move(text), score);
+  }
+
+  if (filter.deduplicate) {
+    std::stable_sort(outputs.begin(), outputs.end(),
+                     [](const auto &a, const auto &b) {
+                       return a.second > b.second;
+                     });
+    if (outputs.size() > num_return_sequences) {
+      outputs.resize(num_return_sequences);
+    }
+  }
+  return outputs;
+}
+
+// Packs the strings into one UTF-8 arena delimited by `strings.size() + 1`
+// offsets, so that results cost a constant number of Lean allocations instead
+// of one per string. Matches `PackedResults` in `FFI.lean`.
+inline lean_obj_res mk_lean_packed(const std::vector<std::string> &strings,
+                                   const std::vector<double> &scores) {
+  size_t size = 0;
+  for (const std::string &s : strings) {
+    size += s.size();
+  }
+  if (size > UINT32_MAX) {
+    throw std::length_error("Packed results must be smaller than 4 GiB.");
+  }
+
+  lean_object *text = lean_alloc_sarray(1, size, size);
+  lean_object *offsets =
+      lean_mk_empty_array_with_capacity(lean_box(strings.size() + 1));
+  uint8_t *p_text = lean_sarray_cptr(text);
+  size_t offset = 0;
+  offsets = lean_array_push(offsets, lean_box_uint32(0));
+  for (const std::string &s : strings) {
+    std::copy(s.begin(), s.end(), p_text + offset);
+    offset += s.size();
+    offsets = lean_array_push(offsets, lean_box_uint32(offset));
+  }
+
+  lean_object *score_array =
+      lean_alloc_sarray(sizeof(double), scores.size(), scores.size());
+  std::copy(scores.begin(), scores.end(), lean_float_array_cptr(score_array));
+
+  lean_object *packed = lean_alloc_ctor(0, 3, 0);
+  lean_ctor_set(packed, 0, text);
+  lean_ctor_set(packed, 1, offsets);
+  lean_ctor_set(packed, 2, score_array);
+  return packed;
+}
+
+inline lean_obj_res mk_lean_packed(
+    const std::vector<std::pair<std::string, double>> &outputs) {
+  std::vector<std::string> texts;
+  std::vector<double> scores;
+  for (const auto &[text, score] : outputs) {
+    texts.push_back(text);
+    scores.push_back(score);
+  }
+  return mk_lean_packed(texts, scores);
+}
+
+extern "C" lean_obj_res byt5_generate(
+    b_lean_obj_arg _generator,             // GeneratorHandle
+    b_lean_obj_arg _input,                 // String
+    b_lean_obj_arg _target_prefix,         // String
+    uint64_t num_return_sequences,         // UInt64
+    uint64_t beam_size,                    // UInt64
+    uint64_t min_length,                   // UInt64
+    uint64_t max_length,                   // UInt64
+    double length_penalty,                 // Float
+    double patience,                       // Float
+    double temperature,                    // Float
+    uint64_t sampling_topk,                // UInt64
+    b_lean_obj_arg _end_tokens,            // Array String
+    b_lean_obj_arg _suppressed_sequences,  // Array String
+    b_lean_obj_arg _suppressed_endings,    // Array String
+    uint8_t constrain_syntax,              // Bool
+    b_lean_obj_arg _keywords,              // Array String
+    uint8_t deduplicate,                   // Bool
+    uint64_t deadline_ms,                  // UInt64
+    uint8_t priority,                      // UInt8
+    b_lean_obj_arg _cancelled,             // IO Bool
+    lean_obj_arg /* w */) {
+  return mk_lean_io_result([&] {
+    GeneratorHandle &generator = to_handle<GeneratorHandle>(_generator);
+    Cancellation cancellation(_cancelled, deadline_ms);
+    ctranslate2::TranslationOptions opts =
+        make_translation_options(num_return_sequences, beam_size, min_length,
+                                 max_length, length_penalty, patience,
+                                 temperature, sampling_topk);
+    set_byt5_stop_conditions(opts, _end_tokens, _suppressed_sequences,
+                             _suppressed_endings);
+    Byt5OutputFilter filter{static_cast<bool>(constrain_syntax),
+                            {convert_tokens(_keywords)},
+                            static_cast<bool>(deduplicate)};
+
+    std::vector<std::string> input_tokens = byt5_tokenize(_input);
+    input_tokens.push_back(byt5_eos_token);
+    std::vector<std::string> target_prefix_tokens =
+        byt5_tokenize(_target_prefix);
+
+    ctranslate2::TranslationResult results =
+        generate_aux(generator, input_tokens, target_prefix_tokens, opts,
+                     cancellation, static_cast<Priority>(priority));
+    return mk_lean_generation(
+        mk_lean_packed(byt5_outputs(results, num_return_sequences, filter)),
+        cancellation);
+  });
+}
+
+// Outputs of a generation running in the background, queued as they finish
+// so that Lean can use the first ones, e.g., check them, while the rest are
+// still being decoded. ctranslate2 only reports decoding steps when
+// `beam_size == 1`, so beam search queues all outputs once it completes.
+struct GenerationStream {
+  std::mutex mutex;
+  std::condition_variable cv;
+  uint64_t num_return_sequences;
+  Byt5OutputFilter filter;
+  std::vector<std::string> end_tokens;
+  std::vector<std::string> target_prefix_tokens;
+  // Tokens and log-probabilities of unfinished hypotheses by id.
+  std::unordered_map<size_t, std::pair<std::vector<std::string>, double>>
+      hypotheses;
+  std::deque<std::pair<std::string, double>> queue;
+  std::unordered_set<std::string> queued;
+  std::shared_future<ctranslate2::TranslationResult> future;
+  bool done = false;
+  std::atomic<bool> stopped = false;
+
+  // Queues `text` unless filtered out, already queued, or there are already
+  // `num_return_sequences` outputs. Requires `mutex`.
+  void push(std::string text, double score) {
+    if (filter.deduplicate) {
+      text = normalize_tactic(text);
+    }
+    if (queued.size() >= num_return_sequences ||
+        (filter.constrain_syntax && !filter.syntax.accepts(text)) ||
+        !queued.insert(text).second) {
+      return;
+    }
+    queue.emplace_back(std::move(text), score);
+    cv.notify_one();
+  }
+
+  // Called by ctranslate2's worker threads. Returns whether to stop decoding.
+  bool on_step(const ctranslate2::GenerationStepResult &step) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto [it, inserted] = hypotheses.try_emplace(
+        step.hypothesis_id, target_prefix_tokens, 0.0);
+    auto &[tokens, log_prob] = it->second;
+    log_prob += step.score.value_or(0.0f);
+    if (std::find(end_tokens.begin(), end_tokens.end(), step.token) ==
+        end_tokens.end()) {
+      tokens.push_back(step.token);
+    }
+    if (step.is_last) {
+      push(byt5_detokenize(tokens), std::exp(log_prob));
+      hypotheses.erase(it);
+    }
+    return stopped;
+  }
+
+  // Queues the outputs not queued yet once decoding completes. Requires
+  // `mutex`.
+  void finish() {
+    for (auto &[text, score] :
+         byt5_outputs(future.get(), num_return_sequences, filter)) {
+      push(std::move(text), score);
+    }
+    done = true;
+  }
+};
+
+// Owned by Lean. Stops greedy decoding and sampling when Lean drops it, e.g.,
+// once a tactic closes the goal, and keeps the generator alive until then.
+struct GenerationStreamHandle {
+  std::shared_ptr<GenerationStream> p_stream;
+  lean_object *_generator;
+
+  ~GenerationStreamHandle() {
+    p_stream->stopped = true;
+    lean_dec(_generator);
+  }
+};
+
+extern "C" lean_obj_res byt5_generate_stream(
+    b_lean_obj_arg _generator,             // GeneratorHandle
+    b_lean_obj_arg _input,                 // String
+    b_lean_obj_arg _target_prefix,         // String
+    uint64_t num_return_sequences,         // UInt64
+    uint64_t beam_size,                    // UInt64
+    uint64_t min_length,                   // UInt64
+    uint64_t max_length,                   // UInt64
+    double length_penalty,                 // Float
+    double patience,                       // Float
+    double temperature,                    // Float
+    uint64_t sampling_topk,                // UInt64
+    b_lean_obj_arg _end_tokens,            // Array String
+    b_lean_obj_arg _suppressed_sequences,  // Array String
+    b_lean_obj_arg _suppressed_endings,    // Array String
+    uint8_t constrain_syntax,              // Bool
+    b_lean_obj_arg _keywords,              // Array String
+    uint8_t deduplicate,                   // Bool
+    uint8_t priority,                      // UInt8
+    b_lean_obj_arg _cancelled,             // IO Bool
+    lean_obj_arg /* w */) {
+  return mk_lean_io_result([&] {
+    GeneratorHandle &generator = to_handle<GeneratorHandle>(_generator);
+    Cancellation cancellation(_cancelled);
+    ctranslate2::TranslationOptions opts =
+        make_translation_options(num_return_sequences, beam_size, min_length,
+                                 max_length, length_penalty, patience,
+                                 temperature, sampling_topk);
+    set_byt5_stop_conditions(opts, _end_tokens, _suppressed_sequences,
+                             _suppressed_endings);
+    auto p_stream = std::make_shared<GenerationStream>();
+    p_stream->num_return_sequences = num_return_sequences;
+    p_stream->filter = {static_cast<bool>(constrain_syntax),
+                        {convert_tokens(_keywords)},
+                        static_cast<bool>(deduplicate)};
+    p_stream->end_tokens = std::get<std::vector<std::string>>(opts.end_token);
+    p_stream->target_prefix_tokens = byt5_tokenize(_target_prefix);
+    if (opts.beam_size == 1) {
+      opts.callback = [p_stream](ctranslate2::GenerationStepResult step) {
+        return p_stream->on_step(step);
+      };
+    }
+
+    // Streams wait for a replica like other generations, and are empty if
+    // cancelled or rejected first.
+    std::vector<std::string> input_tokens = byt5_tokenize(_input);
+    input_tokens.push_back(byt5_eos_token);
+    if (std::optional<Scheduler::Slot> slot = generator.scheduler->acquire(
+            static_cast<Priority>(priority), cancellation)) {
+      p_stream->future =
+          std::move(generator.model->translate_batch_async(
+                        {input_tokens}, {p_stream->target_prefix_tokens},
+                        opts)[0])
+              .share();
+      release_when_ready(std::move(*slot), p_stream->future);
+    } else {
+      p_stream->done = true;
+    }
+
+    lean_inc(_generator);
+    return mk_lean_generation(
+        lean_alloc_external(
+            handle_class<GenerationStreamHandle>(),
+            new GenerationStreamHandle{std::move(p_stream), _generator}),
+        cancellation);
+  });
+}
+
+// Waits for the next output of `_stream`, or returns none once all are
+// returned or `_cancelled` returns true.
+extern "C" lean_obj_res generation_stream_next(
+    b_lean_obj_arg _stream,       // GenerationStream
+    b_lean_obj_arg _cancelled,    // IO Bool
+    lean_obj_arg /* w */) {
+  return mk_lean_io_result([&] {
+    GenerationStream &stream =
+        *to_handle<GenerationStreamHandle>(_stream).p_stream;
+    Cancellation cancellation(_cancelled);
+    std::unique_lock<std::mutex> lock(stream.mutex);
+    while (stream.queue.empty() && !stream.done) {
+      if (stream.future.wait_for(std::chrono::seconds(0)) ==
+          std::future_status::ready) {
+        stream.finish();
+      } else if (!stream.cv.wait_for(lock, std::chrono::milliseconds(10),
+                                     [&] { return !stream.queue.empty(); })) {
+        // `_cancelled` may take a while, so the workers shouldn't wait.
+        lock.unlock();
+        bool cancelled = cancellation.poll();
+        lock.lock();
+        if (cancelled) {
+          stream.stopped = true;
+          return lean_box(0);
+        }
+      }
+    }
+    if (stream.queue.empty()) {
+      return lean_box(0);
+    }
+    auto [text, score] = std::move(stream.queue.front());
+    stream.queue.pop_front();
+    lean_object *output = lean_alloc_ctor(1, 1, 0);
+    lean_ctor_set(output, 0,
+                  lean_mk_pair(mk_lean_string(text), lean_box_float(score)));
+    return output;
+  });
+}
+
+// Generates for several target prefixes of the same input in one batch
+// instead of one `generate` call per prefix. ctranslate2 doesn't accept
+// precomputed encoder outputs, so the input is still encoded once per prefix,
+// as identical and hence unpadded rows: the batch only saves the per-call
+// overhead, e.g., waiting for a replica once and sharing kernel launches.
+// Returns no outputs for any prefix if cancelled.
+extern "C" lean_obj_res byt5_generate_prefixes(
+    b_lean_obj_arg _generator,             // GeneratorHandle
+    b_lean_obj_arg _input,                 // String
+    b_lean_obj_arg _target_prefixes,       // Array String
+    uint64_t num_return_sequences,         // UInt64
+    uint64_t beam_size,                    // UInt64
+    uint64_t min_length,                   // UInt64
+    uint64_t max_length,                   // UInt64
+    double length_penalty,                 // Float
+    double patience,                       // Float
+    double temperature,                    // Float
+    uint64_t sampling_topk,                // UInt64
+    b_lean_obj_arg _end_tokens,            // Array String
+    b_lean_obj_arg _suppressed_sequences,  // Array String
+    b_lean_obj_arg _suppressed_endings,    // Array String
+    uint8_t constrain_syntax,              // Bool
+    b_lean_obj_arg _keywords,              // Array String
+    uint8_t deduplicate,                   // Bool
+    uint8_t priority,                      // UInt8
+    b_lean_obj_arg _cancelled,             // IO Bool
+    lean_obj_arg /* w */) {
+  return mk_lean_io_result([&] {
+    GeneratorHandle &generator = to_handle<GeneratorHandle>(_generator);
+    Cancellation cancellation(_cancelled);
+    ctranslate2::TranslationOptions opts =
+        make_translation_options(num_return_sequences, beam_size, min_length,
+                                 max_length, length_penalty, patience,
+                                 temperature, sampling_topk);
+    set_byt5_stop_conditions(opts, _end_tokens, _suppressed_sequences,
+                             _suppressed_endings);
+    Byt5OutputFilter filter{static_cast<bool>(constrain_syntax),
+                            {convert_tokens(_keywords)},
+                            static_cast<bool>(deduplicate)};
+
+    std::vector<std::string> input_tokens = byt5_tokenize(_input);
+    input_tokens.push_back(byt5_eos_token);
+    std::vector<std::vector<std::string>> target_prefixes =
+        byt5_tokenize_each(_target_prefixes);
+    std::vector<std::vector<std::string>> inputs(target_prefixes.size(),
+                                                 input_tokens);
+
+    // Greedy decoding and sampling stop at the next step once cancelled.
+    cancellation.stop_decoding_when_interrupted(opts);
+    std::optional<std::vector<ctranslate2::TranslationResult>> results =
+        run_scheduled(*generator.scheduler, static_cast<Priority>(priority),
+                      cancellation, [&] {
+                        return generator.model->translate_batch_async(
+                            inputs, target_prefixes, opts);
+                      });
+    cancellation.throw_if_rejected();
+    if (!results || cancellation.poll()) {
+      results.emplace(target_prefixes.size());
+    }
+    assert(results->size() == target_prefixes.size());
+
+    lean_object *output = lean_mk_empty_array();
+    for (const ctranslate2::TranslationResult &result : *results) {
+      output = lean_array_push(
+          output,
+          mk_lean_outputs(byt5_outputs(result, num_return_sequences, filter)));
+    }
+    return output;
+  });
+}
+
+// ctranslate2's alternatives mode expands the `num_alternatives` most likely
+// tokens right after the target prefix and completes each of them greedily,
+// all in one decoding pass, which is much cheaper than a beam search for
+// interactive autocompletion.
+inline ctranslate2::TranslationOptions make_alternatives_options(
+    uint64_t num_alternatives, uint64_t max_length) {
+  ctranslate2::TranslationOptions opts = make_translation_options(
+      num_alternatives, 1, 0, max_length, 0.0, 1.0, 1.0, 1);
+  opts.return_alternatives = true;
+  return opts;
+}
+
+extern "C" lean_obj_res generate_alternatives(
+    b_lean_obj_arg _generator,             // GeneratorHandle
+    b_lean_obj_arg _input_tokens,          // Array String
+    b_lean_obj_arg _target_prefix_tokens,  // Array String
+    uint64_t num_alternatives,             // UInt64
+    uint64_t max_length,                   // UInt64
+    b_lean_obj_arg _end_tokens,            // Array String
+    b_lean_obj_arg _eos_token,             // String
+    lean_obj_arg /* w */) {
+  return mk_lean_io_result([&] {
+    GeneratorHandle &generator = to_handle<GeneratorHandle>(_generator);
+    ctranslate2::TranslationOptions opts =
+        make_alternatives_options(num_alternatives, max_length);
+    set_end_tokens(opts, convert_tokens(_end_tokens),
+                   lean_string_cstr(_eos_token));
+
+    Cancellation cancellation;
+    ctranslate2::TranslationResult results =
+        generate_aux(generator, convert_tokens(_input_tokens),
+                     convert_tokens(_target_prefix_tokens), opts, cancellation);
+    cancellation.throw_if_rejected();
+
+    lean_object *output = lean_mk_empty_array();
+    for (size_t i = 0; i < results.hypotheses.size(); i++) {
+      lean_object *tokens = lean_mk_empty_array();
+      for (const std::string &token : results.hypotheses[i]) {
+        tokens = lean_array_push(tokens, mk_lean_string(token));
+      }
+      double score = hypothesis_score(results, i);
+      output =
+          lean_array_push(output, lean_mk_pair(tokens, lean_box_float(score)));
+    }
+    return output;
+  });
+}
+
+extern "C" lean_obj_res byt5_generate_alternatives(
+    b_lean_obj_arg _generator,      // GeneratorHandle
+    b_lean_obj_arg _input,          // String
+    b_lean_obj_arg _target_prefix,  // String
+    uint64_t num_alternatives,      // UInt64
+    uint64_t max_length,            // UInt64
+    b_lean_obj_arg _end_tokens,     // Array String
+    lean_obj_arg /* w */) {
+  return mk_lean_io_result([&] {
+    GeneratorHandle &generator = to_handle<GeneratorHandle>(_generator);
+    ctranslate2::TranslationOptions opts =
+        make_alternatives_options(num_alternatives, max_length);
+    set_end_tokens(opts, byt5_end_tokens(_end_tokens), byt5_eos_token);
+
+    std::vector<std::string> input_tokens = byt5_tokenize(_input);
+    input_tokens.push_back(byt5_eos_token);
+    Cancellation cancellation;
+    ctranslate2::TranslationResult results =
+        generate_aux(generator, input_tokens, byt5_tokenize(_target_prefix),
+                     opts, cancellation);
+    cancellation.throw_if_rejected();
+
+    std::vector<std::pair<std::string, double>> outputs;
+    for (size_t i = 0; i < results.hypotheses.size(); i++) {
+      outputs.emplace_back(byt5_detokenize(results.hypotheses[i]),
+                           hypothesis_score(results, i));
+    }
+    return mk_lean_outputs(outputs);
+  });
+}
+
+extern "C" lean_obj_res generate_ids(
+    b_lean_obj_arg _generator,          // GeneratorHandle
+    b_lean_obj_arg _input_ids,          // Array UInt32
+    b_lean_obj_arg _target_prefix_ids,  // Array UInt32
+    uint64_t num_return_sequences,      // UInt64
+    uint64_t beam_size,                 // UInt64
+    uint64_t min_length,                // UInt64
+    uint64_t max_length,                // UInt64
+    double length_penalty,              // Float
+    double patience,                    // Float
+    double temperature,                 // Float
+    uint64_t sampling_topk,             // UInt64
+    b_lean_obj_arg _end_token_ids,      // Array UInt32
+    uint32_t eos_token_id,              // UInt32
+    b_lean_obj_arg _suppressed_ids,     // Array (Array UInt32)
+    b_lean_obj_arg _suppressed_ending_ids,  // Array (Array UInt32)
+    uint64_t deadline_ms,                   // UInt64
+    uint8_t priority,                       // UInt8
+    b_lean_obj_arg _cancelled,              // IO Bool
+    lean_obj_arg /* w */) {
+  return mk_lean_io_result([&] {
+    GeneratorHandle &generator = to_handle<GeneratorHandle>(_generator);
+    Cancellation cancellation(_cancelled, deadline_ms);
+    ctranslate2::TranslationOptions opts =
+        make_translation_options(num_return_sequences, beam_size, min_length,
+                                 max_length, length_penalty, patience,
+                                 temperature, sampling_topk);
+    if (!generator.vocabularies) {
+      throw std::runtime_error("Cannot find the model's vocabulary files.");
+    }
+    const auto &[source_vocab, target_vocab] = *generator.vocabularies;
+    std::vector<std::string> end_tokens =
+        ids_to_tokens(_end_token_ids, target_vocab);
+    const std::string &eos_token = target_vocab.to_token(eos_token_id);
+    set_end_tokens(opts, end_tokens, eos_token);
+    set_suppressed_sequences(
+        opts, id_lists_to_tokens(_suppressed_ids, target_vocab),
+        id_lists_to_tokens(_suppressed_ending_ids, target_vocab), end_tokens,
+        eos_token);
+
+    std::vector<std::string> input_tokens =
+        ids_to_tokens(_input_ids, source_vocab);
+    std::vector<std::string> target_prefix_tokens =
+        ids_to_tokens(_target_prefix_ids, target_vocab);
+
+    ctranslate2::TranslationResult results =
+        generate_aux(generator, input_tokens, target_prefix_tokens, opts,
+                     cancellation, static_cast<Priority>(priority));
+
+    lean_object *output = lean_mk_empty_array();
+    for (size_t i = 0; i < results.hypotheses.size(); i++) {
+      const std::vector<std::string> &hypothesis = results.hypotheses[i];
+      lean_object *ids = lean_mk_empty_array_with_capacity(
+          lean_box(hypothesis.size()));
+      for (const std::string &token : hypothesis) {
+        ids = lean_array_push(ids, lean_box_uint32(target_vocab.to_id(token)));
+      }
+      double score = hypothesis_score(results, i);
+      output =
+          lean_array_push(output, lean_mk_pair(ids, lean_box_float(score)));
+    }
+    return mk_lean_generation(output, cancellation);
+  });
+}
+
+// Queue depths of the generator: running generations, waiting ones by
+// priority class, rejected ones so far, and batches queued and running in
+// ctranslate2.
+extern "C" lean_obj_res generator_stats(
+    b_lean_obj_arg _generator,  // GeneratorHandle
+    lean_obj_arg /* w */) {
+  GeneratorHandle &generator = to_handle<GeneratorHandle>(_generator);
+  Scheduler::Stats stats = generator.scheduler->stats();
+  std::vector<uint64_t> values = {stats.num_running,
+                                  stats.num_waiting[0],
+                                  stats.num_waiting[1],
+                                  stats.num_waiting[2],
+                                  stats.num_rejected,
+                                  generator.model->num_queued_batches(),
+                                  generator.model->num_active_batches()};
+  lean_object *arr = lean_mk_empty_array_with_capacity(lean_box(values.size()));
+  for (uint64_t value : values) {
+    arr = lean_array_push(arr, lean_box_uint64(value));
+  }
+  return lean_io_result_mk_ok(arr);
+}
+
+// Runs `_input_tokens` once per replica with the given options, so that later
+// calls don't pay for lazy allocations, kernel selection, and cold caches.
+// Each batch waits for a slot at background priority, so warm-up yields to
+// real requests and is skipped when rejected under load, which means the
+// model is in use anyway. Batches admitted together go to idle replicas.
+extern "C" lean_obj_res warmup_generator(
+    b_lean_obj_arg _generator,      // GeneratorHandle
+    b_lean_obj_arg _input_tokens,   // Array String
+    uint64_t num_return_sequences,  // UInt64
+    uint64_t beam_size,             // UInt64
+    uint64_t max_length,            // UInt64
+    double temperature,             // Float
+    uint64_t sampling_topk,         // UInt64
+    lean_obj_arg /* w */) {
+  return mk_lean_io_result([&] {
+    GeneratorHandle &generator = to_handle<GeneratorHandle>(_generator);
+    ctranslate2::TranslationOptions opts = make_translation_options(
+        num_return_sequences, beam_size, 0, max_length, 1.0, 1.0, temperature,
+        sampling_topk);
+    std::vector<std::string> input_tokens = convert_tokens(_input_tokens);
+    // Background requests can't take every replica, so each slot is freed as
+    // soon as its batch finishes rather than once all are admitted.
+    std::vector<std::shared_future<ctranslate2::TranslationResult>> futures;
+    Cancellation cancellation;
+    for (size_t i = 0; i < generator.model->num_replicas(); i++) {
+      std::optional<Scheduler::Slot> slot =
+          generator.scheduler->acquire(Priority::background, cancellation);
+      if (!slot) {
+        break;
+      }
+      futures.push_back(std::move(generator.model->translate_batch_async(
+                                      {input_tokens}, {{}}, opts)[0])
+                            .share());
+      release_when_ready(std::move(*slot), futures.back());
+    }
+    for (auto &future : futures) {
+      future.get();
+    }
+    return lean_box(0);
+  });
+}
+
+// Scores (input, target) pairs with one teacher-forced forward pass each,
+// batched, instead of searching for targets. Like `hypothesis_score`, a
+// score is the probability of the target followed by EOS.
+inline lean_obj_res score_aux(
+    GeneratorHandle &generator,
+    const std::vector<std::vector<std::string>> &input_tokens,
+    const std::vector<std::vector<std::string>> &target_tokens) {
+  if (input_tokens.size() != target_tokens.size()) {
+    throw std::invalid_argument("Inputs and targets must be paired.");
   }
 
-  std::vector<std::string> input_tokens = convert_tokens(_input_tokens);
-  ctranslate2::EncoderForwardOutput results =
-      encoders.at(name)->forward_batch_async({input_tokens}).get();
-  ctranslate2::StorageView hidden_state = results.last_hidden_state;
+  ctranslate2::ScoringOptions opts;
+  opts.max_input_length = 0;
+  Cancellation cancellation;
+  std::optional<std::vector<ctranslate2::ScoringResult>> results =
+      run_scheduled(*generator.scheduler, Priority::interactive, cancellation,
+                    [&] {
+                      return generator.model->score_batch_async(
+                          input_tokens, target_tokens, opts);
+                    });
+  cancellation.throw_if_rejected();
+  assert(results && results->size() == target_tokens.size());
+
+  lean_object *scores = lean_mk_empty_float_array(lean_box(results->size()));
+  for (const ctranslate2::ScoringResult &result : *results) {
+    lean_float_array_push(scores, std::exp(result.cumulated_score()));
+  }
+  return scores;
+}
+
+extern "C" lean_obj_res score(
+    b_lean_obj_arg _generator,        // GeneratorHandle
+    b_lean_obj_arg _input_tokens,   // Array (Array String)
+    b_lean_obj_arg _target_tokens,  // Array (Array String)
+    lean_obj_arg /* w */) {
+  return mk_lean_io_result([&] {
+    return score_aux(to_handle<GeneratorHandle>(_generator),
+                     convert_token_lists(_input_tokens),
+                     convert_token_lists(_target_tokens));
+  });
+}
 
+extern "C" lean_obj_res byt5_score(
+    b_lean_obj_arg _generator,  // GeneratorHandle
+    b_lean_obj_arg _inputs,     // Array String
+    b_lean_obj_arg _targets,    // Array String
+    lean_obj_arg /* w */) {
+  return mk_lean_io_result([&] {
+    std::vector<std::vector<std::string>> input_tokens =
+        byt5_tokenize_each(_inputs);
+    for (std::vector<std::string> &tokens : input_tokens) {
+      tokens.push_back(byt5_eos_token);
+    }
+    return score_aux(to_handle<GeneratorHandle>(_generator), input_tokens,
+                     byt5_tokenize_each(_targets));
+  });
+}
+
+inline lean_obj_res mean_pool(const ctranslate2::StorageView &hidden_state) {
   assert(hidden_state.dim(0) == 1);
   int l = hidden_state.dim(1);
   int d = hidden_state.dim(2);
@@ -232,15 +1823,82 @@ extern "C" lean_obj_res encode(b_lean_obj_arg _name,            // String
   return arr;
 }
 
+// Returns an empty embedding if cancelled.
+template <typename T>
+inline lean_obj_res encode_aux(EncoderHandle &encoder,
+                               const std::vector<T> &input,
+                               b_lean_obj_arg _cancelled) {
+  std::future<ctranslate2::EncoderForwardOutput> future =
+      encoder.model->forward_batch_async({input});
+  std::optional<ctranslate2::EncoderForwardOutput> results =
+      Cancellation(_cancelled).wait(future);
+  if (!results) {
+    return lean_mk_empty_float_array(lean_box(0));
+  }
+  return mean_pool(results->last_hidden_state);
+}
+
+extern "C" lean_obj_res encode(
+    b_lean_obj_arg _encoder,       // EncoderHandle
+    b_lean_obj_arg _input_tokens,  // Array String
+    b_lean_obj_arg _cancelled,     // IO Bool
+    lean_obj_arg /* w */) {
+  return mk_lean_io_result([&] {
+    return encode_aux(to_handle<EncoderHandle>(_encoder),
+                      convert_tokens(_input_tokens), _cancelled);
+  });
+}
+
+extern "C" lean_obj_res encode_ids(
+    b_lean_obj_arg _encoder,      // EncoderHandle
+    b_lean_obj_arg _input_ids,    // Array UInt32
+    b_lean_obj_arg _cancelled,    // IO Bool
+    lean_obj_arg /* w */) {
+  return mk_lean_io_result([&] {
+    // Unlike `Translator`, `Encoder` accepts ids directly.
+    return encode_aux(to_handle<EncoderHandle>(_encoder),
+                      convert_ids(_input_ids), _cancelled);
+  });
+}
+
+extern "C" lean_obj_res byt5_encode(
+    b_lean_obj_arg _encoder,      // EncoderHandle
+    b_lean_obj_arg _input,        // String
+    b_lean_obj_arg _cancelled,    // IO Bool
+    lean_obj_arg /* w */) {
+  return mk_lean_io_result([&] {
+    std::vector<std::string> input_tokens = byt5_tokenize(_input);
+    input_tokens.push_back(byt5_eos_token);
+    return encode_aux(to_handle<EncoderHandle>(_encoder), input_tokens,
+                      _cancelled);
+  });
+}
+
+// Like `warmup_generator`, but for encoders.
+extern "C" lean_obj_res warmup_encoder(
+    b_lean_obj_arg _encoder,       // EncoderHandle
+    b_lean_obj_arg _input_tokens,  // Array String
+    lean_obj_arg /* w */) {
+  return mk_lean_io_result([&] {
+    EncoderHandle &encoder = to_handle<EncoderHandle>(_encoder);
+    std::vector<std::string> input = convert_tokens(_input_tokens);
+    std::vector<std::future<ctranslate2::EncoderForwardOutput>> futures;
+    for (size_t i = 0; i < encoder.model->num_replicas(); i++) {
+      futures.push_back(encoder.model->forward_batch_async({input}));
+    }
+    for (auto &future : futures) {
+      future.get();
+    }
+    return lean_box(0);
+  });
+}
+
 extern "C" uint8_t init_premise_embeddings(b_lean_obj_arg _path,      // String
                                            b_lean_obj_arg _device) {  // String
   std::string path = std::string(lean_string_cstr(_path));
   if (!exists(path)) {
     return false;
   }
-  if (p_premise_embeddings != nullptr) {
-    delete p_premise_embeddings;
-  }
 
   // ctranslate2::Device device =
   // ctranslate2::str_to_device(lean_string_cstr(_device));
@@ -262,17 +1920,33 @@ extern "C" uint8_t init_premise_embeddings(b_lean_obj_arg _path,      // String
   std::transform(shape.begin(), shape.end(), shape_i64.begin(),
                  [](unsigned long ul) { return static_cast<int64_t>(ul); });
 
-  p_premise_embeddings =
-      new ctranslate2::StorageView(shape_i64, data_f, device);
+  std::atomic_store(&p_premise_embeddings,
+                    std::make_shared<ctranslate2::StorageView>(
+                        shape_i64, data_f, device));
   return true;
 }
 
 inline bool premise_embeddings_initialized_aux() {
-  return p_premise_embeddings != nullptr;
+  return std::atomic_load(&p_premise_embeddings) != nullptr;
 }
 
-extern "C" uint8_t premise_embeddings_initialized(lean_object *) {
-  return premise_embeddings_initialized_aux();
+extern "C" lean_obj_res premise_embeddings_initialized(
+    lean_obj_arg /* w */) {
+  return lean_io_result_mk_ok(lean_box(premise_embeddings_initialized_aux()));
+}
+
+// Size of the loaded premise embeddings in bytes, or 0 if not loaded.
+extern "C" lean_obj_res premise_embeddings_bytes(lean_obj_arg /* w */) {
+  auto p_embeddings = std::atomic_load(&p_premise_embeddings);
+  return lean_io_result_mk_ok(
+      lean_box_uint64(p_embeddings ? p_embeddings->size_in_bytes() : 0));
+}
+
+// Retrievals in progress keep using the embeddings until they finish.
+extern "C" lean_obj_res unload_premise_embeddings(lean_obj_arg /* w */) {
+  std::atomic_store(&p_premise_embeddings,
+                    std::shared_ptr<ctranslate2::StorageView>());
+  return lean_io_result_mk_ok(lean_box(0));
 }
 
 extern "C" uint8_t init_premise_dictionary(b_lean_obj_arg _path) {
@@ -280,29 +1954,39 @@ extern "C" uint8_t init_premise_dictionary(b_lean_obj_arg _path) {
   if (!exists(path)) {
     return false;
   }
-  if (p_premise_dictionary != nullptr) {
-    delete p_premise_dictionary;
-  }
 
   std::ifstream f(path);
-  p_premise_dictionary = new json(json::parse(f));
+  std::atomic_store(&p_premise_dictionary,
+                    std::make_shared<json>(json::parse(f)));
 
   return true;
 }
 
 inline bool premise_dictionary_initialized_aux() {
-  return p_premise_dictionary != nullptr;
+  return std::atomic_load(&p_premise_dictionary) != nullptr;
 }
 
-extern "C" uint8_t premise_dictionary_initialized(lean_object *) {
-  return premise_dictionary_initialized_aux();
+extern "C" lean_obj_res premise_dictionary_initialized(
+    lean_obj_arg /* w */) {
+  return lean_io_result_mk_ok(lean_box(premise_dictionary_initialized_aux()));
 }
 
-extern "C" lean_obj_res retrieve(b_lean_obj_arg _query_emb,
-                                 uint64_t _k) {  // FloatArray
+extern "C" lean_obj_res unload_premise_dictionary(lean_obj_arg /* w */) {
+  std::atomic_store(&p_premise_dictionary, std::shared_ptr<json>());
+  return lean_io_result_mk_ok(lean_box(0));
+}
+
+// The indices and scores of the `_k` premises closest to `_query_emb`.
+inline std::vector<std::pair<int, float>> retrieve_aux(
+    b_lean_obj_arg _query_emb,  // FloatArray
+    uint64_t _k) {              // UInt64
   // lean_object *arr
   // assert(p_premise_embeddings && static_cast<int64_t>(p_arr->m_size) ==
   // p_premise_embeddings->dim(1));
+  auto p_embeddings = std::atomic_load(&p_premise_embeddings);
+  if (p_embeddings == nullptr) {
+    return {};
+  }
 
   int64_t d = lean_unbox(lean_float_array_size(_query_emb));
   std::vector<float> query_emb_data;
@@ -310,7 +1994,7 @@ extern "C" lean_obj_res retrieve(b_lean_obj_arg _query_emb,
     query_emb_data.push_back(lean_float_array_uget(_query_emb, i));
   }
 
-  ctranslate2::Device device = p_premise_embeddings->device();
+  ctranslate2::Device device = p_embeddings->device();
   ctranslate2::StorageView query_emb =
       ctranslate2::StorageView({d, 1}, query_emb_data, device);
 
@@ -318,12 +2002,12 @@ extern "C" lean_obj_res retrieve(b_lean_obj_arg _query_emb,
   long int k = static_cast<long int>(_k);
   ctranslate2::ops::TopK topk(k, -1);
 
-  int num_premises = p_premise_embeddings->dim(0);
+  int num_premises = p_embeddings->dim(0);
   std::vector<int64_t> probs_shape{num_premises, 1};
 
   ctranslate2::StorageView probs = ctranslate2::StorageView(
       probs_shape, ctranslate2::DataType::FLOAT32, device);
-  matmul(*p_premise_embeddings, query_emb, probs);
+  matmul(*p_embeddings, query_emb, probs);
   probs.resize({num_premises});
 
   ctranslate2::StorageView topk_values =
@@ -332,20 +2016,30 @@ extern "C" lean_obj_res retrieve(b_lean_obj_arg _query_emb,
       ctranslate2::StorageView({k}, ctranslate2::DataType::INT32, device);
   topk(probs, topk_values, topk_indices);
 
-  lean_object *output = lean_mk_empty_array();
   const int *p_topk_indices = topk_indices.data<int>();
   const float *p_topk_values = topk_values.data<float>();
-
+  std::vector<std::pair<int, float>> premises;
   for (int i = 0; i < k; i++) {
     int idx = p_topk_indices[i];
     assert(0 < idx && idx < num_premises);
+    premises.emplace_back(idx, p_topk_values[i]);
+  }
+  return premises;
+}
+
+extern "C" lean_obj_res retrieve(b_lean_obj_arg _query_emb,
+                                 uint64_t _k) {  // FloatArray
+  lean_object *output = lean_mk_empty_array();
+  auto p_dictionary = std::atomic_load(&p_premise_dictionary);
+  if (p_dictionary == nullptr) {
+    return output;
+  }
+  for (const auto &[idx, score] : retrieve_aux(_query_emb, _k)) {
     // [NOTE]: This is where the server crash occurs on CUDA.
     const std::string this_premise =
-        (*p_premise_dictionary)[std::to_string(idx)]["full_name"];
-    const std::string this_path =
-        (*p_premise_dictionary)[std::to_string(idx)]["path"];
-    const std::string this_code =
-        (*p_premise_dictionary)[std::to_string(idx)]["code"];
+        (*p_dictionary)[std::to_string(idx)]["full_name"];
+    const std::string this_path = (*p_dictionary)[std::to_string(idx)]["path"];
+    const std::string this_code = (*p_dictionary)[std::to_string(idx)]["code"];
 
     output = lean_array_push(
         output,
@@ -353,8 +2047,28 @@ extern "C" lean_obj_res retrieve(b_lean_obj_arg _query_emb,
             lean_mk_string(this_premise.c_str()),
             lean_mk_pair(lean_mk_string(this_path.c_str()),
                          lean_mk_pair(lean_mk_string(this_code.c_str()),
-                                      lean_box_float(p_topk_values[i])))));
+                                      lean_box_float(score)))));
   }
 
   return output;
 }
+
+// Like `retrieve`, but packs each premise's full name, path, and code.
+extern "C" lean_obj_res retrieve_packed(
+    b_lean_obj_arg _query_emb,  // FloatArray
+    uint64_t _k) {              // UInt64
+  std::vector<std::string> strings;
+  std::vector<double> scores;
+  auto p_dictionary = std::atomic_load(&p_premise_dictionary);
+  if (p_dictionary == nullptr) {
+    return mk_lean_packed(strings, scores);
+  }
+  for (const auto &[idx, score] : retrieve_aux(_query_emb, _k)) {
+    const json &premise = (*p_dictionary)[std::to_string(idx)];
+    strings.push_back(premise["full_name"].get<std::string>());
+    strings.push_back(premise["path"].get<std::string>());
+    strings.push_back(premise["code"].get<std::string>());
+    scores.push_back(score);
+  }
+  return mk_lean_packed(strings, scores);
+}